@@ -5,14 +5,111 @@
 * This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
 */
 
+#define _USE_MATH_DEFINES
+#include <iostream>
+#include <cstring>
 #include "ColourSystem.h"
 
+#define COMB_ANTIPHASE_TOLERANCE -0.95
+
+//Triangle filter, widened to cover the whole step when shrinking, much like SWS_BILINEAR does it. Weights that would fall off either end are dropped and the rest normalised.
+static LineResampler MakeLineResampler(int inWidth, int outWidth)
+{
+	double scale = (double)inWidth / (double)outWidth;
+	double radius = scale > 1.0 ? scale : 1.0;
+	int taps = (int)ceil(radius * 2.0) + 1;
+	if (taps > inWidth) taps = inWidth;
+	LineResampler resampler = { new int[outWidth], new float[outWidth * taps], taps, outWidth };
+	for (int k = 0; k < outWidth; k++)
+	{
+		double center = ((double)k + 0.5) * scale - 0.5;
+		int start = (int)floor(center - radius) + 1;
+		if (start < 0) start = 0;
+		if (start > inWidth - taps) start = inWidth - taps;
+		resampler.starts[k] = start;
+		float* weights = resampler.weights + k * taps;
+		double total = 0.0;
+		for (int t = 0; t < taps; t++)
+		{
+			double weight = 1.0 - fabs((double)(start + t) - center) / radius;
+			if (weight < 0.0) weight = 0.0;
+			weights[t] = (float)weight;
+			total += weight;
+		}
+		for (int t = 0; t < taps; t++)
+		{
+			weights[t] = (float)(weights[t] / total);
+		}
+	}
+	return resampler;
+}
+
+static void FreeLineResampler(LineResampler resampler)
+{
+	delete[] resampler.starts;
+	delete[] resampler.weights;
+}
+
+static void ResampleLine(const float* in, LineResampler resampler, unsigned char* out)
+{
+	const int taps = resampler.taps;
+	for (int k = 0; k < resampler.width; k++)
+	{
+		const float* weights = resampler.weights + k * taps;
+		const float* src = in + resampler.starts[k];
+		float acc = 0.5f; //For rounding
+		for (int t = 0; t < taps; t++)
+		{
+			acc += weights[t] * src[t];
+		}
+		out[k] = (unsigned char)CD_CLAMP(acc, 0.0f, 255.0f);
+	}
+}
+
 ColourSystem::ColourSystem()
 {
 	bcParams = &SystemI;
+	combMode = CombFilterModes::CombOff;
+	combFieldDelay = 0;
+	combVSwitch = false;
+	compactSignals = false;
+	for (int i = 0; i < COMB_FIELD_HISTORY; i++)
+	{
+		combFieldHistory[i] = nullptr;
+		combCompactHistory[i] = nullptr;
+		combFieldHistoryIds[i] = -1;
+	}
+	for (int i = 0; i < SIGNAL_STREAMS; i++)
+	{
+		streamHistories[i] = MakeSignalHistory();
+	}
+	activeWidth = 0;
+	signalLength = 0;
+	precision = KernelPrecision::PrecisionDouble;
+	scanlineJitterLimit = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		decodeScanlineBuffers[i] = nullptr;
+	}
+	prefilterCacheEntries = 2;
+	lumaResampler = { nullptr, nullptr, 0, 0 };
+	chromaResampler = { nullptr, nullptr, 0, 0 };
+	for (int i = 0; i < 2; i++)
+	{
+		prefilterCache[i].contentId = 0;
+		prefilterCache[i].parity = i;
+		prefilterCache[i].streamCount = 0;
+		prefilterCache[i].signalCount = 0;
+		for (int j = 0; j < PREFILTER_CACHE_SIGNALS; j++)
+		{
+			prefilterCache[i].streamsBefore[j] = MakeSignalHistory();
+			prefilterCache[i].streamsAfter[j] = MakeSignalHistory();
+			prefilterCache[i].signals[j] = { nullptr, 0, nullptr };
+		}
+	}
 }
 
-ColourSystem::ColourSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent)
+ColourSystem::ColourSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent) : ColourSystem()
 {
 	switch (sys)
 	{
@@ -53,6 +150,343 @@ ColourSystem::ColourSystem(BroadcastSystems sys, bool interlace, double resonanc
 	}
 }
 
+//Every 8-bit value, from sRGB to the gamma the standard expects
+void ColourSystem::SetupEncodeGamma(double gamma)
+{
+	for (int i = 0; i < 256; i++)
+	{
+		encodeGammaTable[i] = (float)pow(SRGBGammaTransform(i / 255.0), 1.0 / gamma);
+	}
+}
+
+//Turns a scanline of pixels into the three components (Y and the two colour difference signals), after gamma correction
+void ColourSystem::EncodeScanline(const unsigned char* red, const unsigned char* green, const unsigned char* blue, int width, float* comp0, float* comp1, float* comp2)
+{
+	const float* const gammaTable = encodeGammaTable;
+	const float m0 = RGBtoYCCConversionMatrix[0];
+	const float m1 = RGBtoYCCConversionMatrix[1];
+	const float m2 = RGBtoYCCConversionMatrix[2];
+	const float m3 = RGBtoYCCConversionMatrix[3];
+	const float m4 = RGBtoYCCConversionMatrix[4];
+	const float m5 = RGBtoYCCConversionMatrix[5];
+	const float m6 = RGBtoYCCConversionMatrix[6];
+	const float m7 = RGBtoYCCConversionMatrix[7];
+	const float m8 = RGBtoYCCConversionMatrix[8];
+	#pragma omp simd
+	for (int j = 0; j < width; j++)
+	{
+		float R = gammaTable[red[j]];
+		float G = gammaTable[green[j]];
+		float B = gammaTable[blue[j]];
+		comp0[j] = m0 * R + m1 * G + m2 * B;
+		comp1[j] = m3 * R + m4 * G + m5 * B;
+		comp2[j] = m6 * R + m7 * G + m8 * B;
+	}
+}
+
+//Encodes into a signal from the pool, to be given back with FreeSignal()
+SignalPack ColourSystem::Encode(ComponentFrame imgdat, int field)
+{
+	return Encode(imgdat, field, AllocSignal(signalLength));
+}
+
+//Turns a planar GBR frame (as sws_scale gives it in AV_PIX_FMT_GBRP) into the components Encode works from. This only has to be done once per source frame, and only for the lines (every rowStep-th from firstRow) that actually get encoded.
+void ColourSystem::IngestFrame(unsigned char* const* gbrPlanes, const int* lineSizes, ComponentFrame frame, int firstRow, int rowStep)
+{
+	#pragma omp parallel for
+	for (int i = firstRow; i < frame.height; i += rowStep)
+	{
+		int offset = i * frame.width;
+		EncodeScanline(gbrPlanes[2] + i * lineSizes[2], gbrPlanes[0] + i * lineSizes[0], gbrPlanes[1] + i * lineSizes[1], frame.width, frame.planes[0] + offset, frame.planes[1] + offset, frame.planes[2] + offset);
+	}
+}
+
+//The whole curve from the gamma corrected value to an 8-bit sRGB value is smooth and never steeper than about 1.3, so linear interpolation over 1024 steps stays well within one step of 8-bit output
+void ColourSystem::SetupDecodeGamma(double gamma)
+{
+	for (int i = 0; i <= DECODE_GAMMA_TABLE_SIZE; i++)
+	{
+		double linear = pow((double)i / (double)DECODE_GAMMA_TABLE_SIZE, gamma);
+		decodeGammaTable[i] = (float)(CD_CLAMP(SRGBInverseGammaTransform(linear), 0.0, 1.0) * 255.0);
+	}
+	decodeGammaTable[DECODE_GAMMA_TABLE_SIZE + 1] = decodeGammaTable[DECODE_GAMMA_TABLE_SIZE]; //So the top entry can be interpolated from as well
+}
+
+//Call this early in the constructor, before anything is sized from the width. The output width starts off the same.
+void ColourSystem::SetActiveWidth(int width)
+{
+	activeWidth = width;
+	for (int i = 0; i < 3; i++)
+	{
+		delete[] decodeScanlineBuffers[i];
+		decodeScanlineBuffers[i] = new float[activeWidth];
+	}
+	SetOutputWidth(activeWidth);
+}
+
+//Single precision is checked against double precision on a scanline of colour bars first, so any trouble with it at this sample rate shows up straight away
+void ColourSystem::SetKernelPrecision(KernelPrecision prec, double carrierPhaseStep)
+{
+	precision = prec;
+	if (precision == KernelPrecision::PrecisionSingle)
+	{
+		int scanlineSamples = (int)(activeWidth * (bcParams->scanlineTime / bcParams->activeTime));
+		std::cout << "Using single precision kernels (worst difference from double precision: " << MeasureKernelPrecisionError(scanlineSamples, carrierPhaseStep) << ")." << std::endl;
+	}
+}
+
+//The output picture is 4:2:2, so chroma gets resampled to half the width
+void ColourSystem::SetOutputWidth(int width)
+{
+	FreeLineResampler(lumaResampler);
+	FreeLineResampler(chromaResampler);
+	lumaResampler = MakeLineResampler(activeWidth, width);
+	chromaResampler = MakeLineResampler(activeWidth, (width + 1) / 2);
+}
+
+//Turns a scanline of the three components back into RGB, then into the limited range BT.601 YCbCr the output is encoded with, and writes it to the given row of the output picture. If comp2 is null, it's taken as zero.
+void ColourSystem::DecodeScanline(const float* comp0, const float* comp1, const float* comp2, int width, OutputFrame frame, int row)
+{
+	if (row < 0 || row >= frame.height) return;
+	const float* const gammaTable = decodeGammaTable;
+	const float* const c2 = comp2 == nullptr ? comp0 : comp2;
+	const float c2Mult = comp2 == nullptr ? 0.0f : 1.0f;
+	const float m0 = YCCtoRGBConversionMatrix[0];
+	const float m1 = YCCtoRGBConversionMatrix[1];
+	const float m2 = YCCtoRGBConversionMatrix[2] * c2Mult;
+	const float m3 = YCCtoRGBConversionMatrix[3];
+	const float m4 = YCCtoRGBConversionMatrix[4];
+	const float m5 = YCCtoRGBConversionMatrix[5] * c2Mult;
+	const float m6 = YCCtoRGBConversionMatrix[6];
+	const float m7 = YCCtoRGBConversionMatrix[7];
+	const float m8 = YCCtoRGBConversionMatrix[8] * c2Mult;
+	const float tableScale = (float)DECODE_GAMMA_TABLE_SIZE;
+	float* const lumaLine = decodeScanlineBuffers[0];
+	float* const cbLine = decodeScanlineBuffers[1];
+	float* const crLine = decodeScanlineBuffers[2];
+	#pragma omp simd
+	for (int j = 0; j < width; j++)
+	{
+		float val[3];
+		val[0] = m0 * comp0[j] + m1 * comp1[j] + m2 * c2[j];
+		val[1] = m3 * comp0[j] + m4 * comp1[j] + m5 * c2[j];
+		val[2] = m6 * comp0[j] + m7 * comp1[j] + m8 * c2[j];
+		for (int k = 0; k < 3; k++) //Negative values count as black
+		{
+			float t = CD_CLAMP(val[k], 0.0f, 1.0f) * tableScale;
+			int ind = (int)t;
+			float frac = t - (float)ind;
+			val[k] = gammaTable[ind] + (gammaTable[ind + 1] - gammaTable[ind]) * frac;
+		}
+		lumaLine[j] = 16.0f + 0.256788f * val[0] + 0.504129f * val[1] + 0.0979059f * val[2];
+		cbLine[j] = 128.0f - 0.148223f * val[0] - 0.290993f * val[1] + 0.439216f * val[2];
+		crLine[j] = 128.0f + 0.439216f * val[0] - 0.367788f * val[1] - 0.0714275f * val[2];
+	}
+	ResampleLine(lumaLine, lumaResampler, frame.planes[0] + row * frame.lineSizes[0]);
+	ResampleLine(cbLine, chromaResampler, frame.planes[1] + row * frame.lineSizes[1]);
+	ResampleLine(crLine, chromaResampler, frame.planes[2] + row * frame.lineSizes[2]);
+}
+
+//Works out which line and field delays put the subcarrier in antiphase for this broadcast standard, as a real comb filter would be built for it
+void ColourSystem::SetupCombFilter(CombFilterModes mode, double scanlineSamples, double sampleTime, int signalLen, bool vSwitch)
+{
+	combMode = mode;
+	combVSwitch = vSwitch;
+	combFieldDelay = 0;
+	if (mode == CombFilterModes::CombOff) return;
+
+	double carrierAngPerSample = bcParams->carrierAngFreq * sampleTime;
+	int lineDelay = 0;
+	for (int i = 1; i <= 2; i++)
+	{
+		if (vSwitch && (i & 1)) continue; //V would not be in antiphase
+		if (cos(carrierAngPerSample * scanlineSamples * i) < COMB_ANTIPHASE_TOLERANCE)
+		{
+			lineDelay = i;
+			break;
+		}
+	}
+	if (lineDelay == 0)
+	{
+		std::cout << "The subcarrier never lines up in antiphase between scanlines in this broadcast standard, so the comb filter is disabled." << std::endl;
+		combMode = CombFilterModes::CombOff;
+		return;
+	}
+	combLineDelay = MakeDelayLine(scanlineSamples * lineDelay);
+
+	if (mode != CombFilterModes::CombField) return;
+	for (int i = 2; i <= 4; i += 2) //Only look at fields with the same interlace parity
+	{
+		if (vSwitch && (i & 3)) continue; //The V switch also alternates every other field
+		if (cos(bcParams->carrierAngFreq * bcParams->frameTime * i) < COMB_ANTIPHASE_TOLERANCE)
+		{
+			combFieldDelay = i;
+			break;
+		}
+	}
+	if (combFieldDelay == 0)
+	{
+		std::cout << "The subcarrier never lines up in antiphase between fields in this broadcast standard, so a 3 line comb filter is used instead." << std::endl;
+		combMode = CombFilterModes::CombThreeLine;
+		return;
+	}
+	for (int i = 0; i < COMB_FIELD_HISTORY; i++)
+	{
+		if (compactSignals) combCompactHistory[i] = new CompactSample[signalLen];
+		else combFieldHistory[i] = new float[signalLen];
+		combFieldHistoryIds[i] = -1;
+	}
+}
+
+//True if the comb filter looks back a field or more, so it keeps past fields around
+bool ColourSystem::HasCombFieldDelay()
+{
+	return combFieldDelay != 0;
+}
+
+//The fields the 3D comb filter keeps to look back on are the biggest thing it reads each field, and they only need to be good to well below the noise, so they can be kept in 16 bits. Call before the first field is decoded.
+void ColourSystem::SetCompactSignals(bool compact)
+{
+	if (compact == compactSignals) return;
+	compactSignals = compact;
+	if (combFieldDelay == 0) return;
+	for (int i = 0; i < COMB_FIELD_HISTORY; i++)
+	{
+		delete[] combFieldHistory[i];
+		delete[] combCompactHistory[i];
+		combFieldHistory[i] = nullptr;
+		combCompactHistory[i] = nullptr;
+		if (compact) combCompactHistory[i] = new CompactSample[signalLength];
+		else combFieldHistory[i] = new float[signalLength];
+		combFieldHistoryIds[i] = -1;
+	}
+}
+
+SignalPack ColourSystem::CombFilterChroma(SignalPack signal, int field)
+{
+	SignalPack chroma = ApplyCombFilter(signal, combLineDelay, combMode != CombFilterModes::CombTwoLine);
+	if (combMode != CombFilterModes::CombField) return chroma;
+
+	double carrierAngPerField = bcParams->carrierAngFreq * bcParams->frameTime;
+	double fieldPhase = fmod((field % 2500) * carrierAngPerField, 2.0 * M_PI); //Same wrapping as the encoders use
+	int lastSlot = -1;
+	int samePhaseSlot = -1;
+	int lastId = field - combFieldDelay;
+	int samePhaseId = field - 2 * combFieldDelay;
+	if (lastId >= 0 && combFieldHistoryIds[lastId % COMB_FIELD_HISTORY] == lastId)
+	{
+		double lastPhase = fmod((lastId % 2500) * carrierAngPerField, 2.0 * M_PI);
+		if (cos(fieldPhase - lastPhase) < COMB_ANTIPHASE_TOLERANCE) lastSlot = lastId % COMB_FIELD_HISTORY;
+	}
+	if (samePhaseId >= 0 && combFieldHistoryIds[samePhaseId % COMB_FIELD_HISTORY] == samePhaseId)
+	{
+		samePhaseSlot = samePhaseId % COMB_FIELD_HISTORY;
+	}
+	if (lastSlot >= 0)
+	{
+		SignalPack fieldChroma;
+		if (compactSignals) fieldChroma = ApplyFieldCombFilter(signal, chroma, combCompactHistory[lastSlot], samePhaseSlot >= 0 ? combCompactHistory[samePhaseSlot] : nullptr);
+		else fieldChroma = ApplyFieldCombFilter(signal, chroma, combFieldHistory[lastSlot], samePhaseSlot >= 0 ? combFieldHistory[samePhaseSlot] : nullptr);
+		FreeSignal(chroma.signal);
+		chroma = fieldChroma;
+	}
+
+	if (compactSignals) CompactSignal(signal.signal, combCompactHistory[field % COMB_FIELD_HISTORY], signal.len);
+	else memcpy(combFieldHistory[field % COMB_FIELD_HISTORY], signal.signal, signal.len * sizeof(float));
+	combFieldHistoryIds[field % COMB_FIELD_HISTORY] = field;
+	return chroma;
+}
+
+//Gives the signal the end of the last field's signal on the same stream, call AdvanceStream() once all the filters on it are done
+SignalPack ColourSystem::ContinueStream(SignalPack signal, int stream)
+{
+	return { signal.signal, signal.len, streamHistories[stream] };
+}
+
+void ColourSystem::AdvanceStream(SignalPack signal, int stream)
+{
+	PushSignalHistory(streamHistories[stream], signal);
+}
+
+//If the prefiltered signals for this picture and field parity are still around, and the streams are where they were last time, hands those back and moves the streams on as the filters would have. Otherwise gets ready for KeepPrefiltered().
+bool ColourSystem::ReusePrefiltered(unsigned long long contentId, int field, const int* streams, int streamCount, SignalPack* signals, int signalCount)
+{
+	PrefilterCacheEntry* entry = prefilterCache + (prefilterCacheEntries > 1 ? (field & 1) : 0);
+	bool match = contentId != 0 && entry->contentId == contentId && entry->parity == (field & 1) && entry->streamCount == streamCount && entry->signalCount == signalCount;
+	for (int i = 0; match && i < streamCount; i++)
+	{
+		match = entry->streams[i] == streams[i] && !memcmp(entry->streamsBefore[i], streamHistories[streams[i]], SIGNAL_HISTORY_LEN * sizeof(float));
+	}
+	if (match)
+	{
+		for (int i = 0; i < streamCount; i++)
+		{
+			memcpy(streamHistories[streams[i]], entry->streamsAfter[i], SIGNAL_HISTORY_LEN * sizeof(float));
+		}
+		for (int i = 0; i < signalCount; i++)
+		{
+			signals[i] = entry->signals[i];
+		}
+		return true;
+	}
+
+	for (int i = 0; i < entry->signalCount; i++)
+	{
+		FreeSignal(entry->signals[i].signal);
+	}
+	entry->contentId = contentId;
+	entry->parity = field & 1;
+	entry->streamCount = streamCount;
+	entry->signalCount = 0;
+	for (int i = 0; i < streamCount; i++)
+	{
+		entry->streams[i] = streams[i];
+		memcpy(entry->streamsBefore[i], streamHistories[streams[i]], SIGNAL_HISTORY_LEN * sizeof(float));
+	}
+	return false;
+}
+
+//Call once the prefilters are done and the streams advanced. The cache takes over the signals, so don't delete them.
+void ColourSystem::KeepPrefiltered(int field, SignalPack* signals, int signalCount)
+{
+	PrefilterCacheEntry* entry = prefilterCache + (prefilterCacheEntries > 1 ? (field & 1) : 0);
+	for (int i = 0; i < signalCount; i++)
+	{
+		entry->signals[i] = signals[i];
+	}
+	entry->signalCount = signalCount;
+	for (int i = 0; i < entry->streamCount; i++)
+	{
+		memcpy(entry->streamsAfter[i], streamHistories[entry->streams[i]], SIGNAL_HISTORY_LEN * sizeof(float));
+	}
+}
+
+//Call before the first field is encoded
+void ColourSystem::SetPrefilterCacheEntries(int entries)
+{
+	prefilterCacheEntries = entries > 1 ? 2 : 1;
+}
+
+//Only counts what scales with the signal length: the signals in use within a field, the prefiltered signals kept between fields, and the fields the 3D comb filter stores
+long long ColourSystem::EstimateMemoryUse()
+{
+	long long signalBytes = (long long)signalLength * sizeof(float);
+	long long bytes = signalBytes * (SIGNAL_WORKING_SET + prefilterCacheEntries * PREFILTER_CACHE_SIGNALS);
+	if (combFieldDelay != 0) bytes += (long long)signalLength * COMB_FIELD_HISTORY * (compactSignals ? sizeof(CompactSample) : sizeof(float));
+	return bytes;
+}
+
+//Enough samples to carry the highest frequency in the signal (luma plus its vestigial sideband, or the top of the chroma band) with some room to spare, since demodulating the chroma makes components at twice the subcarrier frequency that mustn't alias back into the chroma band
+int GetDefaultActiveWidth(const BroadcastStandard* bcParams, double sampleRateMargin)
+{
+	double highestFreq = bcParams->mainBandwidth + bcParams->sideBandwidth;
+	highestFreq = fmax(highestFreq, bcParams->chromaCarrierFrequency + bcParams->chromaBandwidthUpper);
+	highestFreq = fmax(highestFreq, bcParams->chromaCarrierFrequencyDr + bcParams->chromaBandwidthUpperDr);
+	double sampleRate = fmax(2.0 * highestFreq * sampleRateMargin, 2.0 * bcParams->chromaCarrierFrequency + 4.0 * bcParams->chromaBandwidthLower);
+	int width = (int)ceil(sampleRate * bcParams->activeTime / ACTIVE_WIDTH_ALIGNMENT) * ACTIVE_WIDTH_ALIGNMENT;
+	return width;
+}
+
 const char* GetColourSystemDescriptorString(ColourSystems cSys)
 {
 	switch (cSys)
@@ -65,4 +499,51 @@ const char* GetColourSystemDescriptorString(ColourSystems cSys)
 	case ColourSystems::SECAM:
 		return "SECAM";
 	}
-}
\ No newline at end of file
+}
+
+const char* GetCombFilterDescriptorString(CombFilterModes comb)
+{
+	switch (comb)
+	{
+	default:
+	case CombFilterModes::CombOff:
+		return "off";
+	case CombFilterModes::CombTwoLine:
+		return "2 line";
+	case CombFilterModes::CombThreeLine:
+		return "3 line";
+	case CombFilterModes::CombField:
+		return "3D";
+	}
+}
+
+const char* GetQualityDescriptorString(QualityTiers quality)
+{
+	switch (quality)
+	{
+	case QualityTiers::QualityDraft:
+		return "draft";
+	default:
+	case QualityTiers::QualityNormal:
+		return "normal";
+	case QualityTiers::QualityHigh:
+		return "high";
+	}
+}
+
+const QualityProfile* GetQualityProfile(QualityTiers quality)
+{
+	static const QualityProfile draftProfile = { 64, 0.06, 1.1, true, KernelPrecision::PrecisionSingle };
+	static const QualityProfile normalProfile = { 256, 0.03, 1.5, false, KernelPrecision::PrecisionDouble };
+	static const QualityProfile highProfile = { 256, 0.01, 2.0, false, KernelPrecision::PrecisionDouble };
+	switch (quality)
+	{
+	case QualityTiers::QualityDraft:
+		return &draftProfile;
+	default:
+	case QualityTiers::QualityNormal:
+		return &normalProfile;
+	case QualityTiers::QualityHigh:
+		return &highProfile;
+	}
+}
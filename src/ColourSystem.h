@@ -7,18 +7,55 @@
 
 #pragma once
 #include <math.h>
+#include <string.h>
 #include "BroadcastStandard.h"
 #include "Utils.h"
+#include "SignalPool.h"
 
 #define PREFILTER_RESONANCE 2.0
-#define FIXEDWIDTH 1152
+#define ACTIVE_WIDTH_ALIGNMENT 16
+#define COMB_FIELD_HISTORY 8
+#define SIGNAL_STREAMS 8
+#define DECODE_GAMMA_TABLE_SIZE 1024
+#define PREFILTER_CACHE_SIGNALS 4
+#define STREAM_BAND_LINES 8 //Scanlines the FIR decode chain takes at a time, few enough that every stage's share of a band is still in cache for the next
+#define SIGNAL_WORKING_SET 12 //Roughly how many full field signals a colour system has in use at once
 
 typedef struct
 {
-	int* image; //assumed to be an array of 0xAARRGGBB
+	unsigned char* planes[3]; //Y, Cb and Cr planes of a YUV422P picture, so the last two are half width
+	int lineSizes[3];
 	int width;
 	int height;
-} FrameData;
+} OutputFrame;
+
+typedef struct
+{
+	int* starts; //First input sample each output sample is made from
+	float* weights; //taps weights for each output sample
+	int taps;
+	int width;
+} LineResampler;
+
+typedef struct
+{
+	float* planes[3]; //The three components of the colour system (Y and the two colour differences), already gamma corrected, one plane each
+	int width;
+	int height;
+	unsigned long long contentId; //Frames with the same non-zero id hold the same picture, 0 if that isn't known
+} ComponentFrame;
+
+typedef struct
+{
+	unsigned long long contentId;
+	int parity;
+	int streams[PREFILTER_CACHE_SIGNALS];
+	int streamCount;
+	int signalCount;
+	float* streamsBefore[PREFILTER_CACHE_SIGNALS]; //The prefilter stream histories going in, since the start of each prefiltered signal depends on them
+	float* streamsAfter[PREFILTER_CACHE_SIGNALS];
+	SignalPack signals[PREFILTER_CACHE_SIGNALS];
+} PrefilterCacheEntry;
 
 enum ColourSystems
 {
@@ -27,7 +64,35 @@ enum ColourSystems
 	SECAM
 };
 
+enum CombFilterModes
+{
+	CombOff,
+	CombTwoLine,
+	CombThreeLine,
+	CombField
+};
+
+enum QualityTiers
+{
+	QualityDraft,
+	QualityNormal,
+	QualityHigh
+};
+
+typedef struct
+{
+	int filterTaps; //Most taps a designed FIR filter can have on each side (no more than SIGNAL_HISTORY_LEN)
+	double filterTolerance; //FIR filters end once their taps have stayed under this for a few samples
+	double sampleRateMargin; //How far above the Nyquist rate of the highest frequency in the signal the default sample rate sits
+	bool fieldDoubling; //Only simulate one field of each frame, and line double it to fill in the other
+	KernelPrecision precision; //Of the carrier modulation and demodulation
+} QualityProfile;
+
 const char* GetColourSystemDescriptorString(ColourSystems cSys);
+const char* GetCombFilterDescriptorString(CombFilterModes comb);
+const char* GetQualityDescriptorString(QualityTiers quality);
+const QualityProfile* GetQualityProfile(QualityTiers quality);
+int GetDefaultActiveWidth(const BroadcastStandard* bcParams, double sampleRateMargin);
 
 class ColourSystem
 {
@@ -36,14 +101,90 @@ public:
 	ColourSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent);
 
 	const BroadcastStandard* bcParams;
+	int activeWidth; //Samples across the active part of each scanline, which sets the sample rate of the whole signal
+	int signalLength; //Samples in the signal for each field
 
-	virtual SignalPack Encode(FrameData imgdat, int field) = 0;
-	virtual FrameData Decode(SignalPack signal, int field, double crosstalk) = 0;
+	void IngestFrame(unsigned char* const* gbrPlanes, const int* lineSizes, ComponentFrame frame, int firstRow, int rowStep);
+	SignalPack Encode(ComponentFrame imgdat, int field);
+	virtual SignalPack Encode(ComponentFrame imgdat, int field, float* output) = 0; //The output needs room for signalLength samples
+	void SetOutputWidth(int width);
+	void SetCompactSignals(bool compact);
+	bool HasCombFieldDelay();
+	void SetPrefilterCacheEntries(int entries);
+	long long EstimateMemoryUse();
+	virtual void Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame) = 0;
 	virtual SignalPack AddText(SignalPack signal, const char* text, double x, int y, bool yRelativeToBottom) = 0;
 
 protected:
 	const double* RGBtoYCCConversionMatrix;
 	const double* YCCtoRGBConversionMatrix;
+	float encodeGammaTable[256]; //8-bit sRGB value straight to the gamma corrected value, since there are only 256 of them
+
+	float decodeGammaTable[DECODE_GAMMA_TABLE_SIZE + 2]; //Gamma corrected value to 8-bit sRGB value (not yet truncated), interpolated between entries
+
+	void SetActiveWidth(int width);
+	void SetKernelPrecision(KernelPrecision prec, double carrierPhaseStep);
+	void SetupEncodeGamma(double gamma);
+	void SetupDecodeGamma(double gamma);
+	void EncodeScanline(const unsigned char* red, const unsigned char* green, const unsigned char* blue, int width, float* comp0, float* comp1, float* comp2);
+	void DecodeScanline(const float* comp0, const float* comp1, const float* comp2, int width, OutputFrame frame, int row);
+
+	//The decoder writes each scanline straight into the output picture, resampling it to the output width on the way
+	LineResampler lumaResampler;
+	LineResampler chromaResampler;
+	float* decodeScanlineBuffers[3];
+
+	KernelPrecision precision;
+	int scanlineJitterLimit; //In samples, either way
+
+	//Jitter can only move a scanline as far as the blanking around it, or the first and last lines would be read from outside the signal
+	inline void SetScanlineJitterLimit(const int* activeSignalStarts, int lines, int len)
+	{
+		int blankingAfter = len - (activeSignalStarts[lines - 1] + activeWidth);
+		scanlineJitterLimit = activeSignalStarts[0] < blankingAfter ? activeSignalStarts[0] : blankingAfter;
+		if (scanlineJitterLimit < 0) scanlineJitterLimit = 0;
+	}
+
+	//How much of a FIR filter's output can be worked out once its input is ready up to inputDone
+	inline int GetBandFrontier(int inputDone, int len, FIRFilter fir)
+	{
+		if (inputDone >= len) return len;
+		return inputDone > fir.backport ? inputDone - fir.backport : 0;
+	}
+
+	inline void ReadComponentScanline(ComponentFrame frame, int scanline, float* comp0, float* comp1, float* comp2)
+	{
+		int offset = scanline * frame.width;
+		memcpy(comp0, frame.planes[0] + offset, frame.width * sizeof(float));
+		memcpy(comp1, frame.planes[1] + offset, frame.width * sizeof(float));
+		memcpy(comp2, frame.planes[2] + offset, frame.width * sizeof(float));
+	}
+
+	//Comb filter decoding, only meaningful for the QAM systems
+	CombFilterModes combMode;
+	DelayLine combLineDelay;
+	int combFieldDelay; //In fields, 0 if no field delay puts the subcarrier in antiphase
+	bool combVSwitch; //Whether the V component switches phase with each scanline (PAL)
+	float* combFieldHistory[COMB_FIELD_HISTORY];
+	CompactSample* combCompactHistory[COMB_FIELD_HISTORY]; //Used instead of combFieldHistory with compact signals
+	bool compactSignals;
+	int combFieldHistoryIds[COMB_FIELD_HISTORY];
+
+	void SetupCombFilter(CombFilterModes mode, double scanlineSamples, double sampleTime, int signalLen, bool vSwitch);
+	SignalPack CombFilterChroma(SignalPack signal, int field);
+
+	//Each signal that goes through filters is treated as one continuous stream across fields, so the filters pick up where they left off
+	float* streamHistories[SIGNAL_STREAMS];
+
+	SignalPack ContinueStream(SignalPack signal, int stream);
+	void AdvanceStream(SignalPack signal, int stream);
+
+	//The prefiltered signals of the last field of each parity. If the same picture comes round again for that parity with the same stream histories, they come out the same, so they are reused.
+	PrefilterCacheEntry prefilterCache[2];
+	int prefilterCacheEntries; //One per field parity, or just one to save memory, which means it only helps when every field has the same parity
+
+	bool ReusePrefiltered(unsigned long long contentId, int field, const int* streams, int streamCount, SignalPack* signals, int signalCount);
+	void KeepPrefiltered(int field, SignalPack* signals, int signalCount);
 
 	//These two functions help translate logical RGB values into real values, but it assumes that the video is encoded for the sRGB colourspace. Most videos will fit this description as most people wouldn't really care about that stuff.
 	inline double SRGBGammaTransform(double val)
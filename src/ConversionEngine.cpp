@@ -7,8 +7,8 @@
 
 #include <string>
 #include <iostream>
-#include <random>
 #include "ConversionEngine.h"
+#include "CounterNoise.h"
 
 extern "C"
 {
@@ -16,30 +16,99 @@ extern "C"
 #include <libavutil/opt.h>
 }
 
+#define BLEND_SNAP_THRESHOLD (1.0 / 512.0) //Blend factors this close to 0 or 1 change the picture by under half an 8-bit step, so just use the nearer frame
+
 const char fillChars[5] = { ' ', '-', '=', '#', '@' };
 
-ConversionEngine::ConversionEngine(BroadcastSystems bSys, ColourSystems cSys, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent)
+ConversionEngine::ConversionEngine(BroadcastSystems bSys, ColourSystems cSys, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, CombFilterModes comb, bool iirFilters, QualityTiers quality, bool compactSignals, int activeWidth)
 {
 	//Assumes interlacing for now.
 	switch (cSys)
 	{
 	default:
 	case ColourSystems::PAL:
-		analogueEnc = new PALSystem(bSys, true, resonance, prefilterMult, phaseNoise, scanlineJitter, noiseExponent);
+		analogueEnc = new PALSystem(bSys, true, resonance, prefilterMult, phaseNoise, scanlineJitter, noiseExponent, comb, iirFilters, quality, activeWidth);
 		break;
 	case ColourSystems::NTSC:
-		analogueEnc = new NTSCSystem(bSys, true, resonance, prefilterMult, phaseNoise, scanlineJitter, noiseExponent);
+		analogueEnc = new NTSCSystem(bSys, true, resonance, prefilterMult, phaseNoise, scanlineJitter, noiseExponent, comb, iirFilters, quality, activeWidth);
 		break;
 	case ColourSystems::SECAM:
-		analogueEnc = new SECAMSystem(bSys, true, resonance, prefilterMult, phaseNoise, scanlineJitter, noiseExponent);
+		analogueEnc = new SECAMSystem(bSys, true, resonance, prefilterMult, phaseNoise, scanlineJitter, noiseExponent, iirFilters, quality, activeWidth);
 		break;
 	}
+	analogueEnc->SetCompactSignals(compactSignals);
 	actualFramerate = analogueEnc->bcParams->framerate;
 	actualFrametime = analogueEnc->bcParams->frameTime;
 	alreadyOpen = false;
 	outHeight = analogueEnc->bcParams->videoScanlines;
-	int vsc = analogueEnc->bcParams->videoScanlines;
-	analogueFrameBuffer = new int[vsc * FIXEDWIDTH];
+	analogueWidth = analogueEnc->activeWidth;
+	analogueSignal = new float[analogueEnc->signalLength]; //Each field is encoded into the same buffer
+	scalerFlags = GetScalerFlags(quality);
+	fieldDoubling = GetQualityProfile(quality)->fieldDoubling;
+	frameBlending = true;
+	memoryBudget = 0;
+}
+
+//Has to be set before the video is opened, since that's where the big buffers are made
+void ConversionEngine::SetMemoryBudget(long long bytes)
+{
+	memoryBudget = bytes;
+}
+
+//What the conversion should need once it gets going, not counting the codecs' own state
+long long ConversionEngine::EstimateMemoryUse()
+{
+	long long planeSamples = (long long)analogueWidth * outHeight;
+	long long bytes = planeSamples * 3 * 2; //Scaled GBR source frames
+	bytes += planeSamples * 3 * sizeof(float) * (frameBlending ? 3 : 2); //Component frames
+	bytes += (long long)outWidth * outHeight * 2; //Output picture (4:2:2)
+	bytes += (long long)inWidth * inHeight * 4; //Decoded source picture, assuming no more than 4 bytes a pixel
+	bytes += (long long)analogueEnc->signalLength * sizeof(float); //The analogue signal itself
+	bytes += analogueEnc->EstimateMemoryUse();
+	return bytes;
+}
+
+//Gives up the things that only save time, cheapest first, until the estimate fits in the budget
+void ConversionEngine::FitMemoryBudget()
+{
+	long long estimate = EstimateMemoryUse();
+	if (estimate > memoryBudget && analogueEnc->HasCombFieldDelay())
+	{
+		analogueEnc->SetCompactSignals(true);
+		long long newEstimate = EstimateMemoryUse();
+		if (newEstimate < estimate) std::cout << "Keeping the 3D comb filter's fields in 16 bits to fit the memory budget." << std::endl;
+		estimate = newEstimate;
+	}
+	if (estimate > memoryBudget)
+	{
+		analogueEnc->SetPrefilterCacheEntries(1);
+		long long newEstimate = EstimateMemoryUse();
+		if (newEstimate < estimate) std::cout << "Not keeping prefiltered signals between fields to fit the memory budget." << std::endl;
+		estimate = newEstimate;
+	}
+	if (estimate > memoryBudget && frameBlending)
+	{
+		frameBlending = false;
+		std::cout << "Not blending between source frames to fit the memory budget." << std::endl;
+		estimate = EstimateMemoryUse();
+	}
+	std::cout << "Expecting to use around " << (estimate >> 20) << " MiB, not counting the codecs." << std::endl;
+	if (estimate > memoryBudget) std::cout << "Warning: That's still over the " << (memoryBudget >> 20) << " MiB memory budget." << std::endl;
+}
+
+//The scaler only feeds the encoder, so its filtering just needs to be a bit better than the analogue bandwidth at each tier
+int ConversionEngine::GetScalerFlags(QualityTiers quality)
+{
+	switch (quality)
+	{
+	case QualityTiers::QualityDraft:
+		return SWS_FAST_BILINEAR;
+	default:
+	case QualityTiers::QualityNormal:
+		return SWS_BILINEAR;
+	case QualityTiers::QualityHigh:
+		return SWS_BICUBIC;
+	}
 }
 
 //Sets up our converter upon loading a video file
@@ -61,7 +130,6 @@ void ConversionEngine::OpenForDecodeVideo(const char* inFileName)
 	inWidth = invidcodcontext->width;
 	inHeight = invidcodcontext->height;
 	inPixFormat = invidcodcontext->pix_fmt;
-	vidorigBufsize = av_image_alloc(vidorigData, vidorigLineSize, inWidth, inHeight, inPixFormat, 1);
 	incurFrame = av_frame_alloc();
 	incurPacket = av_packet_alloc();
 	innextPacket = av_packet_alloc();
@@ -84,11 +152,28 @@ void ConversionEngine::OpenForDecodeVideo(const char* inFileName)
 	//Setup rescalers
 	inAspect = ((double)inWidth) / ((double)inHeight);
 	outWidth = (int)((double)outHeight * inAspect * 0.5) * 2;
-	scalercontextForAnalogue = sws_getContext(inWidth, inHeight, inPixFormat, FIXEDWIDTH, outHeight, AVPixelFormat::AV_PIX_FMT_BGRA, SWS_BILINEAR, NULL, NULL, NULL);
-	scalercontextForFinal = sws_getContext(FIXEDWIDTH, outHeight, AVPixelFormat::AV_PIX_FMT_BGRA, outWidth, outHeight, AVPixelFormat::AV_PIX_FMT_YUV422P, SWS_BILINEAR, NULL, NULL, NULL);
-	vidscaleBufsizeForAnalogue = av_image_alloc(vidscaleDataForAnalogue, vidscaleLineSizeForAnalogue, FIXEDWIDTH, outHeight, AVPixelFormat::AV_PIX_FMT_BGRA, 1);
-	vidscaleBufsizeForInterlace = av_image_alloc(vidscaleDataForInterlace, vidscaleLineSizeForInterlace, FIXEDWIDTH, outHeight, AVPixelFormat::AV_PIX_FMT_BGRA, 1);
-	vidscaleBufsizeForFinal = av_image_alloc(vidscaleDataForFinal, vidscaleLineSizeForFinal, outWidth, outHeight, AVPixelFormat::AV_PIX_FMT_YUV422P, 1);
+	scalercontextForAnalogue = sws_getContext(inWidth, inHeight, inPixFormat, analogueWidth, outHeight, AVPixelFormat::AV_PIX_FMT_GBRP, scalerFlags, NULL, NULL, NULL);
+	analogueEnc->SetOutputWidth(outWidth); //The decoder writes straight into the output frames
+	SourceFrame* sourceFrames[2] = { &leftSource, &rightSource };
+	for (int i = 0; i < 2; i++)
+	{
+		vidscaleBufsizeForAnalogue = av_image_alloc(sourceFrames[i]->scaled, sourceFrames[i]->scaledLineSize, analogueWidth, outHeight, AVPixelFormat::AV_PIX_FMT_GBRP, 1);
+		sourceFrames[i]->fieldReady[0] = false;
+		sourceFrames[i]->fieldReady[1] = false;
+	}
+	lastContentId = 0;
+	if (memoryBudget > 0) FitMemoryBudget();
+	ComponentFrame* componentFrames[3] = { &leftSource.components, &rightSource.components, &blendComponents };
+	for (int i = 0; i < (frameBlending ? 3 : 2); i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			componentFrames[i]->planes[j] = new float[analogueWidth * outHeight];
+		}
+		componentFrames[i]->width = analogueWidth;
+		componentFrames[i]->height = outHeight;
+		componentFrames[i]->contentId = 0;
+	}
 	alreadyOpen = true;
 	totalTime = (((double)(invidstream->duration)) * ((double)invidstream->time_base.num)) / ((double)invidstream->time_base.den);
 }
@@ -97,7 +182,6 @@ void ConversionEngine::OpenForDecodeVideo(const char* inFileName)
 void ConversionEngine::CloseDecoder()
 {
 	sws_freeContext(scalercontextForAnalogue);
-	sws_freeContext(scalercontextForFinal);
 	avcodec_free_context(&invidcodcontext);
 	avcodec_free_context(&inaudcodcontext);
 	avformat_close_input(&infmtcontext);
@@ -122,14 +206,41 @@ void ConversionEngine::GenerateTextProgressBar(double progress, int fullLength,
 	}
 }
 
-void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double noise, double crosstalk, const char* tlText, bool timeTextDisplay)
+//Scaled source frames are only turned into components a field at a time, as and when that field is needed
+void ConversionEngine::PrepareSourceField(SourceFrame* source, int interlaceField)
 {
-	//Zero out the buffer just in case
-	for (int i = 0; i < FIXEDWIDTH * outHeight; i++)
+	if (source->fieldReady[interlaceField]) return;
+	analogueEnc->IngestFrame(source->scaled, source->scaledLineSize, source->components, interlaceField, 2);
+	source->fieldReady[interlaceField] = true;
+}
+
+//Spots when a new source frame is just a repeat of the last one (film, animation on twos, slides), so the work already done on that picture can be kept
+void ConversionEngine::IdentifySourceFrame()
+{
+	bool repeat = leftSource.components.contentId != 0;
+	for (int p = 0; repeat && p < 3; p++)
+	{
+		repeat = !memcmp(leftSource.scaled[p], rightSource.scaled[p], rightSource.scaledLineSize[p] * outHeight);
+	}
+	if (!repeat)
 	{
-		analogueFrameBuffer[i] = 0xFF000000;
+		rightSource.components.contentId = ++lastContentId;
+		return;
 	}
+	//Same picture, so the new frame can take over the components already worked out
+	ComponentFrame oldComponents = rightSource.components;
+	rightSource.components = leftSource.components;
+	leftSource.components = oldComponents;
+	leftSource.components.contentId = rightSource.components.contentId;
+	for (int i = 0; i < 2; i++)
+	{
+		rightSource.fieldReady[i] = leftSource.fieldReady[i];
+		leftSource.fieldReady[i] = false;
+	}
+}
 
+bool ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double noise, double crosstalk, const char* tlText, bool timeTextDisplay, bool memoryStats)
+{
 	//Both of these streams are made to be essentially lossless and use fixed codecs to reduce testing burden. Transcoding from the output to other formats is left to other programs.
 
 	//Setup output video stream
@@ -181,6 +292,10 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	outcurFrame->height = outHeight;
 	outcurFrame->flags |= AV_FRAME_FLAG_INTERLACED; //Interlacing forced on
 	av_frame_get_buffer(outcurFrame, 0);
+	//Each field only fills in half the lines, so start from black
+	memset(outcurFrame->data[0], 16, outcurFrame->linesize[0] * outHeight);
+	memset(outcurFrame->data[1], 128, outcurFrame->linesize[1] * outHeight);
+	memset(outcurFrame->data[2], 128, outcurFrame->linesize[2] * outHeight);
 	avcodec_parameters_from_context(outvidstream->codecpar, outvidcodcontext);
 	if (audstreamIndex != AVERROR_STREAM_NOT_FOUND)
 	{
@@ -210,26 +325,16 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	av_dict_free(&opt);
 
 	//Initialise loop
-	unsigned char* rData[4];
-	int rLineSize[4];
-	unsigned char* lDataScaled[4];
-	unsigned char* rDataScaled[4];
-	int lLineSizeScaled[4];
-	int rLineSizeScaled[4];
 	int field = 0;
-	int interlaceField = 0;
 	int numTransSamp = 0;
 	int totalSamp = 0;
 	int totalSampAdv = 0;
 	int64_t curFrame = 0;
 	SignalPack sig;
-	FrameData finData;
 	double curTime = 0.0;
 	double lrefTime = 0.0;
 	double rrefTime = 0.0;
-	av_image_alloc(rData, rLineSize, inWidth, inHeight, inPixFormat, 1);
-	av_image_alloc(lDataScaled, lLineSizeScaled, FIXEDWIDTH, outHeight, AVPixelFormat::AV_PIX_FMT_BGRA, 1);
-	av_image_alloc(rDataScaled, rLineSizeScaled, FIXEDWIDTH, outHeight, AVPixelFormat::AV_PIX_FMT_BGRA, 1);
+	SetMemoryStage(MemoryStages::MemorySource);
 	av_seek_frame(infmtcontext, vidstreamIndex, 0, 0);
 	if (audstreamIndex != AVERROR_STREAM_NOT_FOUND) av_seek_frame(infmtcontext, audstreamIndex, 0, 0);
 	av_read_frame(infmtcontext, incurPacket);
@@ -241,10 +346,8 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 		rrefTime = (((double)incurFrame->pts) * ((double)invidstream->time_base.num)) / ((double)invidstream->time_base.den);
 		if (incurFrame->data[0] != NULL)
 		{
-			av_image_copy(vidorigData, vidorigLineSize, (const unsigned char**)incurFrame->data, incurFrame->linesize, inPixFormat, inWidth, inHeight);
-			av_image_copy(rData, rLineSize, (const unsigned char**)incurFrame->data, incurFrame->linesize, inPixFormat, inWidth, inHeight);
-			sws_scale(scalercontextForAnalogue, vidorigData, vidorigLineSize, 0, inHeight, vidscaleDataForAnalogue, vidscaleLineSizeForAnalogue);
-			sws_scale(scalercontextForAnalogue, rData, rLineSize, 0, inHeight, rDataScaled, rLineSizeScaled);
+			sws_scale(scalercontextForAnalogue, incurFrame->data, incurFrame->linesize, 0, inHeight, rightSource.scaled, rightSource.scaledLineSize); //Straight from the decoder's frame, it's done with before the next one is received
+			IdentifySourceFrame();
 		}
 	}
 	else if (audstreamIndex != AVERROR_STREAM_NOT_FOUND && incurPacket->stream_index == audstreamIndex)
@@ -274,8 +377,8 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	int totalNumFrames = (int)((((double)(invidstream->duration)) * ((double)invidstream->time_base.num)) / ((double)invidstream->time_base.den * actualFrametime));
 	if (totalNumFrames < 0) totalNumFrames = INT32_MAX;
 	if (preview && totalNumFrames >= 300) totalNumFrames = 300;
-	std::mt19937_64 rng;
-	std::uniform_real_distribution<> ndist(-noise, noise);
+	const float noiseAmp = (float)noise;
+	uint64_t audioNoiseCounter = 0; //Audio samples noised so far
 	char progString[256];
 	char progBar[256];
 	int framesInSecond = (int)(analogueEnc->bcParams->framerate + 0.5);
@@ -287,47 +390,76 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	int soundWritePos = 0;
 	for (int i = 0; i < totalNumFrames; i++)
 	{
+		BeginMemoryField();
+		SetMemoryStage(MemoryStages::MemoryEncode);
 		av_frame_make_writable(outcurFrame);
 		outcurFrame->flags |= AV_FRAME_FLAG_INTERLACED; //Interlacing forced on
 		double dt = rrefTime - lrefTime;
-		if (i != 0)
+		int interlaceField = field & 1; //Interlacing is forced on, so only every other line of the source is needed for each field
+		if (!fieldDoubling || interlaceField == 0) //Otherwise the last frame's line doubled field just gets sent again
 		{
-			//Blend the two frames around the actual time point (reduces frame jitter)
-			double mixFac = (curTime - lrefTime)/dt;
-			double lmixFac = 1.0 - mixFac;
-			unsigned char* limg = lDataScaled[0];
-			unsigned char* rimg = rDataScaled[0];
-			unsigned char* oimg = vidscaleDataForAnalogue[0];
-			for (int j = 0; j < FIXEDWIDTH * outHeight * 4; j++)
+			double mixFac = (i == 0 || leftSource.components.contentId == rightSource.components.contentId) ? 1.0 : (curTime - lrefTime) / dt; //A repeated picture needs no blending
+			double snapThreshold = frameBlending ? BLEND_SNAP_THRESHOLD : 0.5;
+			if (!(mixFac < 1.0 - snapThreshold)) //When the frame rates match, the field time nearly always lands right on a source frame
 			{
-				double lC = (double)limg[j];
-				double rC = (double)rimg[j];
-				double oC = lmixFac * lC + mixFac * rC;
-				oimg[j] = (unsigned char)oC;
+				PrepareSourceField(&rightSource, interlaceField);
+				sig = analogueEnc->Encode(rightSource.components, field, analogueSignal);
+			}
+			else if (mixFac <= snapThreshold)
+			{
+				PrepareSourceField(&leftSource, interlaceField);
+				sig = analogueEnc->Encode(leftSource.components, field, analogueSignal);
+			}
+			else
+			{
+				//Blend the two frames around the actual time point (reduces frame jitter)
+				PrepareSourceField(&leftSource, interlaceField);
+				PrepareSourceField(&rightSource, interlaceField);
+				const float rmix = (float)mixFac;
+				const float lmix = 1.0f - rmix;
+				const int fieldLines = (outHeight - interlaceField + 1) / 2;
+				const int width = analogueWidth;
+				#pragma omp parallel for
+				for (int k = 0; k < fieldLines * 3; k++)
+				{
+					int p = k / fieldLines;
+					int offset = ((k % fieldLines) * 2 + interlaceField) * width;
+					const float* limg = leftSource.components.planes[p] + offset;
+					const float* rimg = rightSource.components.planes[p] + offset;
+					float* oimg = blendComponents.planes[p] + offset;
+					#pragma omp simd
+					for (int j = 0; j < width; j++)
+					{
+						oimg[j] = lmix * limg[j] + rmix * rimg[j];
+					}
+				}
+				sig = analogueEnc->Encode(blendComponents, field, analogueSignal);
+			}
+			if (tlText != nullptr) sig = analogueEnc->AddText(sig, tlText, 0.15, 16, false);
+			if (timeTextDisplay)
+			{
+				char timer[32];
+				int seconds = i / framesInSecond;
+				sprintf(timer, "%02i:%02i:%02i:%02i", seconds / 3600, (seconds / 60) % 60, seconds % 60, i % framesInSecond);
+				sig = analogueEnc->AddText(sig, timer, 0.15, 32, true);
+			}
+			if (noiseAmp != 0.0f) AddUniformNoise(sig.signal, sig.len, noiseAmp, NOISE_SEED, NoiseStreams::NoiseStreamSignal, (uint64_t)field << 32); //Will be replaced with a generic signal transform function soon
+			//Note that the video is technically progressive scan, but we force interlacing through the content to support codecs which don't allow interlaced scan
+			OutputFrame outFrame = { { outcurFrame->data[0], outcurFrame->data[1], outcurFrame->data[2] }, { outcurFrame->linesize[0], outcurFrame->linesize[1], outcurFrame->linesize[2] }, outWidth, outHeight };
+			SetMemoryStage(MemoryStages::MemoryDecode);
+			analogueEnc->Decode(sig, field, crosstalk, outFrame);
+			if (fieldDoubling)
+			{
+				#pragma omp parallel for
+				for (int k = 0; k < (outHeight / 2) * 3; k++)
+				{
+					int p = k % 3;
+					int row = (k / 3) * 2;
+					memcpy(outcurFrame->data[p] + (row + 1) * outcurFrame->linesize[p], outcurFrame->data[p] + row * outcurFrame->linesize[p], outcurFrame->linesize[p]);
+				}
 			}
 		}
-		sig = analogueEnc->Encode({ (int*)vidscaleDataForAnalogue[0], FIXEDWIDTH, outHeight }, field);
-		if (tlText != nullptr) sig = analogueEnc->AddText(sig, tlText, 0.15, 16, false);
-		if (timeTextDisplay)
-		{
-			char timer[32];
-			int seconds = i / framesInSecond;
-			sprintf(timer, "%02i:%02i:%02i:%02i", seconds / 3600, (seconds / 60) % 60, seconds % 60, i % framesInSecond);
-			sig = analogueEnc->AddText(sig, timer, 0.15, 32, true);
-		}
-		for (int j = 0; j < sig.len; j++) //Will be replaced with a generic signal transform function soon
-		{
-			sig.signal[j] += ndist(rng);
-		}
-		finData = analogueEnc->Decode(sig, field, crosstalk);
-		for (int j = 0; j < analogueEnc->bcParams->videoScanlines / 2; j++) //We only got half a frame out, so we assume interlacing and copy appropriately
-		{
-			memcpy(analogueFrameBuffer + (finData.width * (j * 2 + interlaceField)), finData.image + (finData.width * j), finData.width * 4);
-		}
-		//Note that the video is technically progressive scan, but we force interlacing through the content to support codecs which don't allow interlaced scan
-		memcpy(vidscaleDataForInterlace[0], analogueFrameBuffer, finData.width * outHeight * 4);
-		sws_scale(scalercontextForFinal, vidscaleDataForInterlace, vidscaleLineSizeForInterlace, 0, outHeight, vidscaleDataForFinal, vidscaleLineSizeForFinal);
-		av_image_copy(outcurFrame->data, outcurFrame->linesize, (const unsigned char**)vidscaleDataForFinal, vidscaleLineSizeForFinal, AVPixelFormat::AV_PIX_FMT_YUV422P, outWidth, outHeight);
+		SetMemoryStage(MemoryStages::MemoryOutput);
 		outcurFrame->pts = curFrame;
 		avcodec_send_frame(outvidcodcontext, outcurFrame);
 		avcodec_receive_packet(outvidcodcontext, outcurPacket);
@@ -340,6 +472,7 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 
 		curTime = actualFrametime * (i + 1);
 
+		SetMemoryStage(MemoryStages::MemorySource);
 		int streamStatus = 0;
 		while (rrefTime < curTime)
 		{
@@ -357,9 +490,13 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 				rrefTime = (((double)incurFrame->pts) * ((double)invidstream->time_base.num)) / ((double)invidstream->time_base.den);
 				if (incurFrame->data[0] != NULL)
 				{
-					av_image_copy(lDataScaled, lLineSizeScaled, rDataScaled, rLineSizeScaled, AVPixelFormat::AV_PIX_FMT_BGRA, FIXEDWIDTH, outHeight);
-					av_image_copy(rData, rLineSize, (const unsigned char**)incurFrame->data, incurFrame->linesize, inPixFormat, inWidth, inHeight);
-					sws_scale(scalercontextForAnalogue, rData, rLineSize, 0, inHeight, rDataScaled, rLineSizeScaled);
+					SourceFrame oldSource = leftSource; //The old right frame becomes the new left one, so just swap them round
+					leftSource = rightSource;
+					rightSource = oldSource;
+					rightSource.fieldReady[0] = false;
+					rightSource.fieldReady[1] = false;
+					sws_scale(scalercontextForAnalogue, incurFrame->data, incurFrame->linesize, 0, inHeight, rightSource.scaled, rightSource.scaledLineSize);
+					IdentifySourceFrame();
 				}
 			}
 			else if (audstreamIndex != AVERROR_STREAM_NOT_FOUND && incurPacket->stream_index == audstreamIndex)
@@ -376,9 +513,11 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 						if (outaudFrame->data[j])
 						{
 							float* sBuf = (float*)soundBuffer[j];
+							const uint32_t key = GetCounterNoiseKey(NOISE_SEED, NoiseStreams::NoiseStreamAudio + j);
+							#pragma omp simd
 							for (int k = 0; k < numTransSamp; k++)
 							{
-								float inNoise = ndist(rng);
+								float inNoise = noiseAmp * GetUniformNoise(key, audioNoiseCounter + k);
 								if (inNoise > 1.0f) inNoise = 1.0f;
 								else if (inNoise < -1.0f) inNoise = -1.0f;
 								if (inNoise < 0.0f) inNoise *= -inNoise;
@@ -387,6 +526,7 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 							}
 						}
 					}
+					audioNoiseCounter += numTransSamp;
 					while (samplesLeft > 0)
 					{
 						av_frame_make_writable(outaudFrame);
@@ -419,10 +559,8 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 				}
 			}
 		}
+		EndMemoryField(field);
 		field++;
-		interlaceField = field & 1;
-		delete[] sig.signal;
-		delete[] finData.image;
 		sprintf(progString, "Wrote frame %u/%u ", i + 1, totalNumFrames);
 		strcat(progString, "[");
 		GenerateTextProgressBar(((double)(i + 1)) / ((double)totalNumFrames), 78, progBar);
@@ -434,6 +572,7 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	std::cout << std::endl;
 
 	//Write epilogue and finish
+	SetMemoryStage(MemoryStages::MemoryOutput);
 	if (audstreamIndex != AVERROR_STREAM_NOT_FOUND)
 	{
 		av_frame_make_writable(outaudFrame);
@@ -452,6 +591,7 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	{
 		delete[] soundBuffer[i];
 	}
+	ReleaseSignalPool(); //Everything left in it was only ever needed per field
 	av_write_trailer(outfmtcontext);
 	avcodec_free_context(&outvidcodcontext);
 	if (audstreamIndex != AVERROR_STREAM_NOT_FOUND) avcodec_free_context(&outaudcodcontext);
@@ -459,4 +599,7 @@ void ConversionEngine::EncodeVideo(const char* outFileName, bool preview, double
 	av_packet_free(&outcurPacket);
 	avio_closep(&outfmtcontext->pb);
 	avformat_free_context(outfmtcontext);
+	if (memoryStats) return ReportMemoryStats(memoryBudget);
+	if (memoryBudget > 0) ReportPeakMemory(memoryBudget);
+	return true;
 }
@@ -9,6 +9,7 @@
 #include "PALSystem.h"
 #include "NTSCSystem.h"
 #include "SECAMSystem.h"
+#include "MemoryStats.h"
 
 extern "C"
 {
@@ -18,22 +19,35 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
+typedef struct
+{
+	unsigned char* scaled[4]; //The source frame scaled to analogueWidth x outHeight, as planar GBR
+	int scaledLineSize[4];
+	ComponentFrame components;
+	bool fieldReady[2]; //Whether each field's lines have been turned into components yet
+} SourceFrame;
+
 class ConversionEngine
 {
 public:
-	ConversionEngine(BroadcastSystems bSys, ColourSystems cSys, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent);
+	ConversionEngine(BroadcastSystems bSys, ColourSystems cSys, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, CombFilterModes comb, bool iirFilters, QualityTiers quality, bool compactSignals, int activeWidth);
 
+	void SetMemoryBudget(long long bytes);
 	void OpenForDecodeVideo(const char* inFileName);
-    void EncodeVideo(const char* outFileName, bool preview, double noise, double crosstalk, const char* tlText, bool timeTextDisplay);
+    bool EncodeVideo(const char* outFileName, bool preview, double noise, double crosstalk, const char* tlText, bool timeTextDisplay, bool memoryStats); //False if memoryStats found per field allocations
 	void CloseDecoder();
 private:
     void GenerateTextProgressBar(double progress, int fullLength, char* progBarChars);
+    void PrepareSourceField(SourceFrame* source, int interlaceField);
+    void IdentifySourceFrame();
+    static int GetScalerFlags(QualityTiers quality);
+    long long EstimateMemoryUse();
+    void FitMemoryBudget();
     ColourSystem* analogueEnc = NULL;
 	AVFormatContext* infmtcontext = NULL;
 	AVCodecContext* invidcodcontext = NULL;
 	AVCodecContext* inaudcodcontext = NULL;
     SwsContext* scalercontextForAnalogue = NULL;
-    SwsContext* scalercontextForFinal = NULL;
     SwrContext* resamplercontext = NULL;
     AVStream* invidstream = NULL;
     AVStream* inaudstream = NULL;
@@ -73,24 +87,22 @@ private:
     unsigned char* audfullstreamByte;
     int curtotalByteStreamSize;
 
-    unsigned char* vidorigData[4];
-    int vidorigLineSize[4];
     int convnumFrames;
     int frameskip;
     int outWidth;
     int outHeight;
+    int analogueWidth; //Samples across the active part of each scanline in the analogue signal
+    float* analogueSignal;
+    int scalerFlags;
+    bool fieldDoubling; //Only simulate the first field of each frame, and line double it
+    bool frameBlending; //Blend source frames either side of each field's time, otherwise just take the nearer one
+    long long memoryBudget; //In bytes, 0 for no limit
     double actualFramerate;
     double actualFrametime;
     double totalTime;
-    unsigned char* vidscaleDataForAnalogue[4];
-    int vidscaleLineSizeForAnalogue[4];
-    int vidorigBufsize;
     int vidscaleBufsizeForAnalogue;
-    unsigned char* vidscaleDataForInterlace[4];
-    int vidscaleLineSizeForInterlace[4];
-    int vidscaleBufsizeForInterlace;
-    unsigned char* vidscaleDataForFinal[4];
-    int vidscaleLineSizeForFinal[4];
-    int vidscaleBufsizeForFinal;
-    int* analogueFrameBuffer;
+    SourceFrame leftSource; //The source frames either side of the current time
+    SourceFrame rightSource;
+    ComponentFrame blendComponents;
+    unsigned long long lastContentId;
 };
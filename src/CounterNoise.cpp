@@ -0,0 +1,18 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* Counter-based random numbers, for noise that can be made in any order
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#include "CounterNoise.h"
+
+void AddUniformNoise(float* signal, int len, float amplitude, uint64_t seed, uint32_t stream, uint64_t counter)
+{
+	const uint32_t key = GetCounterNoiseKey(seed, stream);
+	#pragma omp parallel for simd
+	for (int i = 0; i < len; i++)
+	{
+		signal[i] += amplitude * GetUniformNoise(key, counter + i);
+	}
+}
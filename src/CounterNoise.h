@@ -0,0 +1,65 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* Counter-based random numbers, for noise that can be made in any order
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#pragma once
+#include <math.h>
+#include <stdint.h>
+
+#define NOISE_SEED 0x56414E414C4F47ull //Fixed, so the same settings always give the same video
+#define PHILOX_ROUNDS 10
+#define PHILOX_MULTIPLIER 0xD256D193u
+#define PHILOX_KEY_STEP 0x9E3779B9u
+
+enum NoiseStreams
+{
+	NoiseStreamSignal,
+	NoiseStreamJitter,
+	NoiseStreamPhase,
+	NoiseStreamAudio //Plus the channel number
+};
+
+//Each number is a pure function of the key and its own counter (Philox2x32), so there's no state to carry from one to the next, and any run of them can be made on its own, in parallel, in any order
+inline uint32_t GetCounterNoiseKey(uint64_t seed, uint32_t stream)
+{
+	return (uint32_t)(seed ^ (seed >> 32)) ^ (stream * 0x85EBCA6Bu);
+}
+
+inline void PhiloxRounds(uint32_t key, uint64_t counter, uint32_t* out0, uint32_t* out1)
+{
+	uint32_t c0 = (uint32_t)counter;
+	uint32_t c1 = (uint32_t)(counter >> 32);
+	for (int i = 0; i < PHILOX_ROUNDS; i++)
+	{
+		uint64_t product = (uint64_t)PHILOX_MULTIPLIER * c0;
+		c0 = (uint32_t)(product >> 32) ^ key ^ c1;
+		c1 = (uint32_t)product;
+		key += PHILOX_KEY_STEP;
+	}
+	*out0 = c0;
+	*out1 = c1;
+}
+
+//In [-1, 1)
+inline float GetUniformNoise(uint32_t key, uint64_t counter)
+{
+	uint32_t r0, r1;
+	PhiloxRounds(key, counter, &r0, &r1);
+	return (float)(int32_t)(r0 & 0xFFFFFF00u) * (1.0f / 2147483648.0f);
+}
+
+//Standard normal, from both halves of the output through Box-Muller
+inline float GetGaussianNoise(uint32_t key, uint64_t counter)
+{
+	uint32_t r0, r1;
+	PhiloxRounds(key, counter, &r0, &r1);
+	float u0 = ((r0 >> 8) + 1) * (1.0f / 16777216.0f); //Never 0, so the log is fine
+	float u1 = (r1 >> 8) * (1.0f / 16777216.0f);
+	return sqrtf(-2.0f * logf(u0)) * cosf(6.28318531f * u1);
+}
+
+//Noise for sample i comes from counter + i, so a signal can be done in pieces and come out the same
+void AddUniformNoise(float* signal, int len, float amplitude, uint64_t seed, uint32_t stream, uint64_t counter);
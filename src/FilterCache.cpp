@@ -0,0 +1,152 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* On-disk cache for designed filters
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <random>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include "FilterCache.h"
+
+#define FILTER_CACHE_MAGIC "VAFC"
+#define FILTER_CACHE_MAX_TAPS 1024
+
+//Each filter gets its own small file: this header, then len + backport floats in the same order as they sit in memory. Being fixed layout, the files can be mapped straight in if need be.
+typedef struct
+{
+	char magic[4];
+	int version;
+	FilterCacheKey key;
+	int len;
+	int backport;
+} FilterCacheHeader;
+
+static void MakeCacheDirectory(const std::string& dir)
+{
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0755);
+#endif
+}
+
+//$XDG_CACHE_HOME/videoanalogiser, or ~/.cache/videoanalogiser if that isn't set. Empty if there's nowhere sensible to put it.
+static std::string GetCacheDirectory()
+{
+	std::string dir;
+	const char* xdgCache = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+#ifdef _WIN32
+	if (home == nullptr || *home == '\0') home = getenv("LOCALAPPDATA");
+#endif
+	if (xdgCache != nullptr && *xdgCache != '\0')
+	{
+		dir = xdgCache;
+	}
+	else if (home != nullptr && *home != '\0')
+	{
+		dir = home;
+		dir += "/.cache";
+		MakeCacheDirectory(dir);
+	}
+	else
+	{
+		return dir;
+	}
+	dir += "/videoanalogiser";
+	MakeCacheDirectory(dir);
+	return dir;
+}
+
+static bool KeysMatch(const FilterCacheKey* a, const FilterCacheKey* b)
+{
+	return a->sampleRate == b->sampleRate && a->center == b->center && a->width == b->width && a->attenuation == b->attenuation && a->size == b->size &&
+		!memcmp(a->designParams, b->designParams, sizeof(a->designParams));
+}
+
+//FNV-1a over the key, just to give each filter a file name. The full key is checked on loading anyway.
+static std::string GetCacheFileName(const FilterCacheKey* key)
+{
+	std::string dir = GetCacheDirectory();
+	if (dir.empty()) return dir;
+	unsigned long long hash = 14695981039346656037ULL;
+	const double params[4] = { key->sampleRate, key->center, key->width, key->attenuation };
+	const unsigned char* bytes = (const unsigned char*)params;
+	for (size_t i = 0; i < sizeof(params); i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	bytes = (const unsigned char*)&key->size;
+	for (size_t i = 0; i < sizeof(key->size); i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	bytes = (const unsigned char*)key->designParams;
+	for (size_t i = 0; i < sizeof(key->designParams); i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "/fir-v%d-%016llx.bin", FILTER_CACHE_VERSION, hash);
+	return dir + name;
+}
+
+bool LoadCachedFIRFilter(const FilterCacheKey* key, FIRFilter* fir)
+{
+	std::string fileName = GetCacheFileName(key);
+	if (fileName.empty()) return false;
+	FILE* cacheFile = fopen(fileName.c_str(), "rb");
+	if (cacheFile == nullptr) return false;
+
+	FilterCacheHeader header;
+	bool ok = fread(&header, sizeof(header), 1, cacheFile) == 1 && !memcmp(header.magic, FILTER_CACHE_MAGIC, 4) && header.version == FILTER_CACHE_VERSION && KeysMatch(&header.key, key) &&
+		header.len > 0 && header.backport >= 0 && header.len + header.backport <= FILTER_CACHE_MAX_TAPS;
+	if (!ok)
+	{
+		fclose(cacheFile);
+		return false;
+	}
+	int truesize = header.len + header.backport;
+	float* taps = new float[truesize];
+	if (fread(taps, sizeof(float), truesize, cacheFile) != (size_t)truesize)
+	{
+		delete[] taps;
+		fclose(cacheFile);
+		return false;
+	}
+	fclose(cacheFile);
+	*fir = { taps + header.len - 1, header.len, header.backport, 0 };
+	return true;
+}
+
+//Writes to a temporary file first and renames it into place, so other processes never see a half-written filter
+void SaveCachedFIRFilter(const FilterCacheKey* key, FIRFilter fir)
+{
+	std::string fileName = GetCacheFileName(key);
+	if (fileName.empty()) return;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%08x.tmp", (unsigned int)std::random_device()());
+	std::string tempName = fileName + suffix;
+	FILE* cacheFile = fopen(tempName.c_str(), "wb");
+	if (cacheFile == nullptr) return;
+
+	FilterCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FILTER_CACHE_MAGIC, 4);
+	header.version = FILTER_CACHE_VERSION;
+	header.key = *key;
+	header.len = fir.len;
+	header.backport = fir.backport;
+	int truesize = fir.len + fir.backport;
+	bool ok = fwrite(&header, sizeof(header), 1, cacheFile) == 1 && fwrite(fir.filter - fir.len + 1, sizeof(float), truesize, cacheFile) == (size_t)truesize;
+	ok = fclose(cacheFile) == 0 && ok;
+	if (!ok || rename(tempName.c_str(), fileName.c_str()) != 0) remove(tempName.c_str());
+}
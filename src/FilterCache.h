@@ -0,0 +1,25 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* On-disk cache for designed filters
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#pragma once
+#include "Utils.h"
+
+//Bump this whenever the filter design changes, so old cache files are ignored
+#define FILTER_CACHE_VERSION 1
+
+typedef struct
+{
+	double sampleRate;
+	double center;
+	double width;
+	double attenuation;
+	int size;
+	int designParams[4]; //Anything else the design depends on (integration points, tolerances), so tweaking them doesn't need a version bump
+} FilterCacheKey;
+
+bool LoadCachedFIRFilter(const FilterCacheKey* key, FIRFilter* fir);
+void SaveCachedFIRFilter(const FilterCacheKey* key, FIRFilter fir);
@@ -0,0 +1,242 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* Heap allocation counters and peak memory use
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#ifdef _WIN32
+#define PSAPI_VERSION 2 //Gets the psapi functions from kernel32, so there's no extra library to link
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#include "MemoryStats.h"
+
+static const char* memoryStageNames[MemoryStageCount] = { "Setup", "Source", "Encode", "Decode", "Output" };
+
+static std::atomic<bool> countingEnabled(false);
+static std::atomic<int> currentStage(MemoryStages::MemorySetup);
+static std::atomic<long long> stageAllocs[MemoryStageCount];
+static std::atomic<long long> stageBytes[MemoryStageCount];
+
+//Per field, on the main thread only
+static long long fieldStageAllocs[MemoryStageCount];
+static long long steadyStageAllocs[MemoryStageCount];
+static long long steadyStageBytes[MemoryStageCount];
+static long long fieldStageBytes[MemoryStageCount];
+static int steadyFieldCount = 0;
+static int allocatingFieldCount = 0;
+static int worstField = -1;
+static long long worstFieldAllocs = 0;
+static int listedFields[MEMORY_STATS_LISTED_FIELDS];
+static long long listedFieldAllocs[MEMORY_STATS_LISTED_FIELDS][MemoryStageCount];
+static long long stagePeakGrowth[MemoryStageCount]; //How much the peak resident size went up while in each stage
+static long long lastPeak = 0;
+static int peakStage = MemoryStages::MemorySetup;
+
+static void* CountedAlloc(size_t size, size_t alignment)
+{
+	if (countingEnabled.load(std::memory_order_relaxed))
+	{
+		int stage = currentStage.load(std::memory_order_relaxed);
+		stageAllocs[stage].fetch_add(1, std::memory_order_relaxed);
+		stageBytes[stage].fetch_add((long long)size, std::memory_order_relaxed);
+	}
+	if (size == 0) size = 1;
+	void* mem;
+	if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+	{
+		mem = malloc(size);
+	}
+	else
+	{
+#ifdef _WIN32
+		mem = _aligned_malloc(size, alignment);
+#else
+		mem = aligned_alloc(alignment, ((size + alignment - 1) / alignment) * alignment);
+#endif
+	}
+	if (mem == nullptr) throw std::bad_alloc();
+	return mem;
+}
+
+static void CountedFree(void* mem, size_t alignment)
+{
+	if (mem == nullptr) return;
+#ifndef _WIN32
+	(void)alignment; //Only _aligned_malloc needs its own free
+#else
+	if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+	{
+		_aligned_free(mem);
+		return;
+	}
+#endif
+	free(mem);
+}
+
+void* operator new(size_t size)
+{
+	return CountedAlloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	return CountedAlloc(size, (size_t)alignment);
+}
+
+void operator delete(void* mem) noexcept
+{
+	CountedFree(mem, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* mem, size_t) noexcept
+{
+	CountedFree(mem, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* mem, std::align_val_t alignment) noexcept
+{
+	CountedFree(mem, (size_t)alignment);
+}
+
+void operator delete(void* mem, size_t, std::align_val_t alignment) noexcept
+{
+	CountedFree(mem, (size_t)alignment);
+}
+
+static void SamplePeakResident()
+{
+	long long peak = GetPeakResidentBytes();
+	if (peak <= lastPeak) return;
+	peakStage = currentStage.load(std::memory_order_relaxed);
+	stagePeakGrowth[peakStage] += peak - lastPeak;
+	lastPeak = peak;
+}
+
+//Call before anything worth counting is allocated. Until then operator new just allocates.
+void EnableMemoryStats()
+{
+	countingEnabled.store(true, std::memory_order_relaxed);
+}
+
+//Only ever called from the main thread, between stages
+void SetMemoryStage(MemoryStages stage)
+{
+	SamplePeakResident();
+	currentStage.store(stage, std::memory_order_relaxed);
+}
+
+void BeginMemoryField()
+{
+	for (int i = 0; i < MemoryStageCount; i++)
+	{
+		fieldStageAllocs[i] = stageAllocs[i].load(std::memory_order_relaxed);
+		fieldStageBytes[i] = stageBytes[i].load(std::memory_order_relaxed);
+	}
+}
+
+//Anything allocated after the warm-up is per field churn that should have come from the signal pool or been made once up front
+void EndMemoryField(int field)
+{
+	if (field < MEMORY_STATS_WARMUP_FIELDS) return;
+	long long allocs = 0;
+	long long stageFieldAllocs[MemoryStageCount];
+	for (int i = 0; i < MemoryStageCount; i++)
+	{
+		stageFieldAllocs[i] = stageAllocs[i].load(std::memory_order_relaxed) - fieldStageAllocs[i];
+		steadyStageAllocs[i] += stageFieldAllocs[i];
+		steadyStageBytes[i] += stageBytes[i].load(std::memory_order_relaxed) - fieldStageBytes[i];
+		allocs += stageFieldAllocs[i];
+	}
+	steadyFieldCount++;
+	if (allocs > 0)
+	{
+		if (allocatingFieldCount < MEMORY_STATS_LISTED_FIELDS)
+		{
+			listedFields[allocatingFieldCount] = field;
+			for (int i = 0; i < MemoryStageCount; i++)
+			{
+				listedFieldAllocs[allocatingFieldCount][i] = stageFieldAllocs[i];
+			}
+		}
+		allocatingFieldCount++;
+	}
+	if (allocs > worstFieldAllocs)
+	{
+		worstFieldAllocs = allocs;
+		worstField = field;
+	}
+}
+
+long long GetPeakResidentBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return (long long)counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage)) return 0;
+	return (long long)usage.ru_maxrss * 1024; //In kilobytes on Linux
+#endif
+}
+
+void ReportPeakMemory(long long budget)
+{
+	SamplePeakResident();
+	if (lastPeak == 0) return;
+	std::cout << "Peak resident size: " << (lastPeak >> 20) << " MiB";
+	if (budget > 0) std::cout << " of the " << (budget >> 20) << " MiB budget";
+	std::cout << ", reached during " << memoryStageNames[peakStage] << "." << std::endl;
+	if (budget > 0 && lastPeak > budget) std::cout << "Warning: Went over the memory budget." << std::endl;
+}
+
+bool ReportMemoryStats(long long budget)
+{
+	std::cout << "Heap allocations by stage (all fields / per field after the first " << MEMORY_STATS_WARMUP_FIELDS << "):" << std::endl;
+	for (int i = 0; i < MemoryStageCount; i++)
+	{
+		double perField = steadyFieldCount > 0 ? (double)steadyStageAllocs[i] / steadyFieldCount : 0.0;
+		double bytesPerField = steadyFieldCount > 0 ? (double)steadyStageBytes[i] / steadyFieldCount : 0.0;
+		std::cout << "  " << memoryStageNames[i] << ": " << stageAllocs[i].load() << " (" << stageBytes[i].load() / 1024 << " KiB) / " << perField << " (" << bytesPerField / 1024.0 << " KiB)" << std::endl;
+	}
+	ReportPeakMemory(budget);
+	if (lastPeak > 0)
+	{
+		std::cout << "Peak resident size increases by stage:" << std::endl;
+		for (int i = 0; i < MemoryStageCount; i++)
+		{
+			std::cout << "  " << memoryStageNames[i] << ": " << (stagePeakGrowth[i] >> 20) << " MiB" << std::endl;
+		}
+	}
+	if (steadyFieldCount == 0)
+	{
+		std::cout << "Too few fields to check for allocations after warm-up." << std::endl;
+		return true;
+	}
+	if (allocatingFieldCount == 0)
+	{
+		std::cout << "No heap allocations in the " << steadyFieldCount << " fields after warm-up." << std::endl;
+		return true;
+	}
+	std::cout << "Error: " << allocatingFieldCount << " of the " << steadyFieldCount << " fields after warm-up allocated, up to " << worstFieldAllocs << " times (field " << worstField << ")." << std::endl;
+	int listed = allocatingFieldCount < MEMORY_STATS_LISTED_FIELDS ? allocatingFieldCount : MEMORY_STATS_LISTED_FIELDS;
+	for (int i = 0; i < listed; i++)
+	{
+		std::cout << "  Field " << listedFields[i] << ":";
+		for (int j = 0; j < MemoryStageCount; j++)
+		{
+			std::cout << " " << memoryStageNames[j] << " " << listedFieldAllocs[i][j] << (j + 1 < MemoryStageCount ? "," : "");
+		}
+		std::cout << std::endl;
+	}
+	if (allocatingFieldCount > listed) std::cout << "  (and " << allocatingFieldCount - listed << " more)" << std::endl;
+	return false;
+}
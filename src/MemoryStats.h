@@ -0,0 +1,30 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* Heap allocation counters and peak memory use
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#pragma once
+
+#define MEMORY_STATS_WARMUP_FIELDS 8 //By then the signal pool and the filter caches have seen every size they need
+#define MEMORY_STATS_LISTED_FIELDS 16 //Fields after warm-up that allocated, listed stage by stage
+
+enum MemoryStages
+{
+	MemorySetup,
+	MemorySource, //Reading, decoding and scaling the source
+	MemoryEncode, //Components, the analogue encoder, text and noise
+	MemoryDecode,
+	MemoryOutput, //Encoding and writing the output
+	MemoryStageCount
+};
+
+//Once enabled, every operator new is counted against whichever stage was set last, whichever thread it comes from. Allocations made inside the libav* libraries don't go through operator new, so they only show up in the peak resident size.
+void EnableMemoryStats();
+void SetMemoryStage(MemoryStages stage);
+void BeginMemoryField();
+void EndMemoryField(int field);
+long long GetPeakResidentBytes(); //0 if it can't be found out
+void ReportPeakMemory(long long budget); //Pass 0 if there's no budget
+bool ReportMemoryStats(long long budget); //False if any field after warm-up allocated
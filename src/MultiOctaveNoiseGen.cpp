@@ -1,18 +1,21 @@
 /*
 * VideoAnalogiser - Command Line Utility for Analogising Digital Videos
-* Maxim Hoxha 2023
+* Maxim Hoxha 2023-2026
 * Multiple octave noise generator
 * This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
 */
 
+#define _USE_MATH_DEFINES
 #include <math.h>
 #include "MultiOctaveNoiseGen.h"
 
 //noise amplitudes go as width^exponent
-MultiOctaveNoiseGen::MultiOctaveNoiseGen(int numOct, double distCenter, double distWidth, double exponent)
+MultiOctaveNoiseGen::MultiOctaveNoiseGen(int numOct, double distCenter, double distWidth, double exponent, NoiseStreams stream)
 {
-	dist = std::uniform_real_distribution<>(distCenter - distWidth, distCenter + distWidth);
-	numOctaves = numOct;
+	key = GetCounterNoiseKey(NOISE_SEED, stream);
+	center = distCenter;
+	width = distWidth;
+	numOctaves = numOct > MAX_NOISE_OCTAVES ? MAX_NOISE_OCTAVES : numOct;
 	exponent -= 1.0;
 	double ampCorr;
 	if (exponent == 0.0)
@@ -23,26 +26,115 @@ MultiOctaveNoiseGen::MultiOctaveNoiseGen(int numOct, double distCenter, double d
 	{
 		ampCorr = ((1.0 - exp2(exponent)) / (1.0 - exp2(exponent * numOct)));
 	}
-	for (int i = 0; i < numOct; i++)
+	for (int i = 0; i < numOctaves; i++)
 	{
 		noiseFilters[i] = 1.0 - exp2((double)-i);
 		noiseAmplitudes[i] = exp2(exponent * i) * ampCorr;
-		noiseChannels[i] = 0.0;
+		noiseHorizons[i] = i == 0 ? 1 : (uint64_t)ceil(-53.0 * M_LN2 / log(noiseFilters[i]));
 	}
-	for (int i = 0; i < 69420; i++) //this number is totally random :)
+	ResetToStationary();
+}
+
+//Start as if the generator had already run forever, instead of burning in. Each octave is a first order filter on uniform noise, so we draw its state from a normal distribution with the filter's steady state mean and variance.
+void MultiOctaveNoiseGen::ResetToStationary()
+{
+	position = 0;
+	for (int i = 0; i < numOctaves; i++)
 	{
-		GenNoise(); //burn-in
+		const double filt = noiseFilters[i];
+		const double mean = center / (1.0 - filt);
+		const double stdDev = width * sqrt(1.0 / (3.0 * (1.0 - filt * filt)));
+		noiseChannels[i] = mean + stdDev * GetGaussianNoise(key, ((uint64_t)(i + MAX_NOISE_OCTAVES) << NOISE_OCTAVE_SHIFT));
 	}
 }
 
+inline double MultiOctaveNoiseGen::DrawUniform(int octave, uint64_t pos)
+{
+	return center + width * GetUniformNoise(key, ((uint64_t)octave << NOISE_OCTAVE_SHIFT) + pos);
+}
+
 double MultiOctaveNoiseGen::GenNoise()
 {
-	double outnum = 0.0;
+	double outnum;
+	Generate(1, &outnum);
+	return outnum;
+}
+
+void MultiOctaveNoiseGen::Generate(int n, double* output)
+{
+	double draws[NOISE_GEN_BATCH];
+	for (int j = 0; j < n; j++)
+	{
+		output[j] = 0.0;
+	}
 	for (int i = 0; i < numOctaves; i++)
 	{
-		const double noisecomp = dist(rng) + noiseChannels[i] * noiseFilters[i];
-		outnum += noisecomp * noiseAmplitudes[i];
-	    noiseChannels[i] = noisecomp;
+		const double filt = noiseFilters[i];
+		const double amp = noiseAmplitudes[i];
+		double channel = noiseChannels[i];
+		for (int start = 0; start < n; start += NOISE_GEN_BATCH)
+		{
+			int count = n - start < NOISE_GEN_BATCH ? n - start : NOISE_GEN_BATCH;
+			#pragma omp simd
+			for (int j = 0; j < count; j++) //The draws are independent, only the filter is serial
+			{
+				draws[j] = DrawUniform(i, position + start + j);
+			}
+			for (int j = 0; j < count; j++)
+			{
+				channel = draws[j] + channel * filt;
+				output[start + j] += channel * amp;
+			}
+		}
+		noiseChannels[i] = channel;
 	}
-	return outnum;
-}
\ No newline at end of file
+	position += n;
+}
+
+//Draws older than an octave's horizon no longer make any difference to it, so a long jump only has to run through the last few
+void MultiOctaveNoiseGen::Skip(uint64_t n)
+{
+	for (int i = 0; i < numOctaves; i++)
+	{
+		const double filt = noiseFilters[i];
+		uint64_t steps = n < noiseHorizons[i] ? n : noiseHorizons[i];
+		double channel = noiseChannels[i] * pow(filt, (double)(n - steps));
+		for (uint64_t j = position + n - steps; j < position + n; j++)
+		{
+			channel = DrawUniform(i, j) + channel * filt;
+		}
+		noiseChannels[i] = channel;
+	}
+	position += n;
+}
+
+void MultiOctaveNoiseGen::Seek(uint64_t pos)
+{
+	if (pos < position) ResetToStationary();
+	Skip(pos - position);
+}
+
+uint64_t MultiOctaveNoiseGen::GetPosition()
+{
+	return position;
+}
+
+NoiseGenState MultiOctaveNoiseGen::GetState()
+{
+	NoiseGenState state;
+	state.position = position;
+	for (int i = 0; i < numOctaves; i++)
+	{
+		state.channels[i] = noiseChannels[i];
+	}
+	return state;
+}
+
+void MultiOctaveNoiseGen::SetState(NoiseGenState state)
+{
+	position = state.position;
+	for (int i = 0; i < numOctaves; i++)
+	{
+		noiseChannels[i] = state.channels[i];
+	}
+}
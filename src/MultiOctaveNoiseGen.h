@@ -1,23 +1,47 @@
 /*
 * VideoAnalogiser - Command Line Utility for Analogising Digital Videos
-* Maxim Hoxha 2023
+* Maxim Hoxha 2023-2026
 * Multiple octave noise generator
 * This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
 */
 
 #pragma once
-#include <random>
+#include <stdint.h>
+#include "CounterNoise.h"
 
+#define MAX_NOISE_OCTAVES 32
+#define NOISE_OCTAVE_SHIFT 48 //Counter bits above this pick the octave, the rest are the position
+#define NOISE_GEN_BATCH 64
+
+typedef struct
+{
+	uint64_t position;
+	double channels[MAX_NOISE_OCTAVES];
+} NoiseGenState;
+
+//Draws come from counter-based noise indexed by position, so the generator can be snapshotted, restored and moved to any position without replaying everything before it
 class MultiOctaveNoiseGen
 {
 public:
-	MultiOctaveNoiseGen(int numOct, double distCenter, double distWidth, double exponent);
+	MultiOctaveNoiseGen(int numOct, double distCenter, double distWidth, double exponent, NoiseStreams stream);
 	double GenNoise();
+	void Generate(int n, double* output);
+	void Skip(uint64_t n);
+	void Seek(uint64_t pos); //Matches the values you'd get by generating up to pos, to within rounding
+	uint64_t GetPosition();
+	NoiseGenState GetState();
+	void SetState(NoiseGenState state);
 private:
-	std::mt19937_64 rng;
-	std::uniform_real_distribution<> dist;
+	uint32_t key;
+	double center;
+	double width;
 	int numOctaves;
-	double noiseAmplitudes[32];
-	double noiseFilters[32];
-	double noiseChannels[32]; //fixed size for efficiency
-};
\ No newline at end of file
+	uint64_t position;
+	double noiseAmplitudes[MAX_NOISE_OCTAVES];
+	double noiseFilters[MAX_NOISE_OCTAVES];
+	uint64_t noiseHorizons[MAX_NOISE_OCTAVES]; //Steps until an octave has forgotten its state to double precision
+	double noiseChannels[MAX_NOISE_OCTAVES]; //fixed size for efficiency
+
+	void ResetToStationary();
+	double DrawUniform(int octave, uint64_t pos);
+};
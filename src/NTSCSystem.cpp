@@ -9,7 +9,7 @@
 #include "NTSCSystem.h"
 #include "VHSFont.h"
 
-NTSCSystem::NTSCSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent)
+NTSCSystem::NTSCSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, CombFilterModes comb, bool iirFilters, QualityTiers quality, int width)
 {
     switch (sys)
     {
@@ -51,44 +51,54 @@ NTSCSystem::NTSCSystem(BroadcastSystems sys, bool interlace, double resonance, d
 
     RGBtoYCCConversionMatrix = RGBtoYIQConversionMatrix;
     YCCtoRGBConversionMatrix = YIQtoRGBConversionMatrix;
+    SetupEncodeGamma(2.2);
+    SetupDecodeGamma(2.2);
 
     interlaced = interlace;
-    activeWidth = FIXEDWIDTH;
+    useIIR = iirFilters;
+    const QualityProfile* profile = GetQualityProfile(quality);
+    SetActiveWidth(width > 0 ? width : GetDefaultActiveWidth(bcParams, profile->sampleRateMargin));
     fieldScanlines = interlace ? bcParams->videoScanlines / 2 : bcParams->videoScanlines;
+    signalLength = (int)(activeWidth * fieldScanlines * (bcParams->scanlineTime / bcParams->activeTime));
     boundaryPoints = new int[fieldScanlines + 1]; //Boundaries of the scanline signals
     activeSignalStarts = new int[fieldScanlines]; //Start points of the active parts
     sampleRate = activeWidth / bcParams->activeTime; //Correction for the fact that the signal we've created only has active scanlines.
     sampleTime = bcParams->activeTime / (double)activeWidth;
+    SetKernelPrecision(profile->precision, bcParams->carrierAngFreq * sampleTime);
     double realScanlineTime = 1.0 / (double)(fieldScanlines * bcParams->framerate);
     int signalLen = (int)(activeWidth * fieldScanlines * (realScanlineTime / bcParams->activeTime)); //To get a good analogue feel, we must limit the vertical resolution; the horizontal resolution will be limited as we decode the distorted signal.
 
     std::cout << "Creating decode filters..." << std::endl;
 
-    mainfir = MakeFIRFilter(sampleRate, 256, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance);
-    qfir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->chromaBandwidthUpper, resonance); //Q has less resolution than I
-    ifir = MakeFIRFilter(sampleRate, 256, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance);
+    if (useIIR) mainiir = MakeIIRFilter(sampleRate, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance);
+    else mainfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance, profile->filterTolerance);
+    if (useIIR) qiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->chromaBandwidthUpper, resonance); //Q has less resolution than I
+    else qfir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->chromaBandwidthUpper, resonance, profile->filterTolerance);
+    if (useIIR) iiir = MakeIIRFilter(sampleRate, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance);
+    else ifir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance, profile->filterTolerance);
 
     std::cout << "Creating prefilters..." << std::endl;
 
-    lumaprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE);
-    iprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE);
-    qprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->chromaBandwidthUpper * prefilterMult, PREFILTER_RESONANCE);
+    if (useIIR) lumapreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE);
+    else lumaprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
+    if (useIIR) ipreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE);
+    else iprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
+    if (useIIR) qpreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->chromaBandwidthUpper * prefilterMult, PREFILTER_RESONANCE);
+    else qprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->chromaBandwidthUpper * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
 
-    jitGen = new MultiOctaveNoiseGen(11, 0.0, scanlineJitter * activeWidth, noiseExponent);
-    phNoiseGen = new MultiOctaveNoiseGen(11, 0.0, phaseNoise, noiseExponent);
+    SetupCombFilter(comb, activeWidth * (bcParams->scanlineTime / bcParams->activeTime), sampleTime, signalLen, false);
+
+    jitGen = new MultiOctaveNoiseGen(11, 0.0, scanlineJitter * activeWidth, noiseExponent, NoiseStreams::NoiseStreamJitter);
+    phNoiseGen = new MultiOctaveNoiseGen(11, 0.0, phaseNoise, noiseExponent, NoiseStreams::NoiseStreamPhase);
+    jitterTrack = new double[fieldScanlines];
+    phaseTrack = new double[fieldScanlines];
 }
 
-SignalPack NTSCSystem::Encode(FrameData imgdat, int field)
+SignalPack NTSCSystem::Encode(ComponentFrame imgdat, int field, float* signalOut)
 {
     double realActiveTime = bcParams->activeTime;
     double realScanlineTime = bcParams->scanlineTime;
     int signalLen = (int)(imgdat.width * fieldScanlines * (realScanlineTime / realActiveTime)); //To get a good analogue feel, we must limit the vertical resolution; the horizontal resolution will be limited as we decode the distorted signal.
-    float* signalOut = new float[signalLen];
-    double R = 0.0;
-    double G = 0.0;
-    double B = 0.0;
-    double Q = 0.0;
-    double I = 0.0;
     int pos = 0;
     int remainingSync = 0;
     double sampleTime = realActiveTime / (double)imgdat.width;
@@ -105,166 +115,235 @@ SignalPack NTSCSystem::Encode(FrameData imgdat, int field)
         activeSignalStarts[i] = (int)((((double)i * (double)signalLen) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * imgdat.width) - boundaryPoints[i];
     }
 
-    int* imgColours = imgdat.image;
     int currentScanline;
     double finSamp = 0.0;
     int w = imgdat.width;
-    int col;
     int interlaceField = field & 1;
     double carrierAngFreq = bcParams->carrierAngFreq;
-    SignalPack Ysig = { new float[signalLen], signalLen };
-    SignalPack Isig = { new float[signalLen], signalLen };
-    SignalPack Qsig = { new float[signalLen], signalLen };
-    //Make component signals
-    for (int i = 0; i < fieldScanlines; i++) //Only generate active scanlines
+    //Prefilter signals, unless this picture has just been through them
+    const int prefilterStreams[3] = { Streams::LumaPreStream, Streams::IPreStream, Streams::QPreStream };
+    SignalPack prefiltered[3];
+    if (!ReusePrefiltered(imgdat.contentId, field, prefilterStreams, 3, prefiltered, 3))
     {
-        currentScanline = interlaced ? (i * 2 + interlaceField) % bcParams->videoScanlines : i;
-        for (int j = 0; j < activeSignalStarts[i]; j++) //Front porch, ignore sync signal because we don't see its results
-        {
-            Ysig.signal[pos] = 0.0f;
-            Isig.signal[pos] = 0.0f;
-            Qsig.signal[pos] = 0.0f;
-            pos++;
-        }
-        for (int j = 0; j < w; j++) //Active signal
+        SignalPack Ysig = { AllocSignal(signalLen), signalLen, nullptr };
+        SignalPack Isig = { AllocSignal(signalLen), signalLen, nullptr };
+        SignalPack Qsig = { AllocSignal(signalLen), signalLen, nullptr };
+        //Make component signals
+        for (int i = 0; i < fieldScanlines; i++) //Only generate active scanlines
         {
-            col = imgColours[currentScanline * w + j];
-            R = ((col & 0x00FF0000) >> 16) / 255.0;
-            G = ((col & 0x0000FF00) >> 8) / 255.0;
-            B = (col & 0x000000FF) / 255.0;
-            R = SRGBGammaTransform(R); //SRGB correction
-            G = SRGBGammaTransform(G);
-            B = SRGBGammaTransform(B);
-            R = pow(R, 1.0 / 2.2); //Gamma correction
-            G = pow(G, 1.0 / 2.2);
-            B = pow(B, 1.0 / 2.2);
-            Ysig.signal[pos] = RGBtoYIQConversionMatrix[0] * R + RGBtoYIQConversionMatrix[1] * G + RGBtoYIQConversionMatrix[2] * B; //Encode Y, Q and I
-            Isig.signal[pos] = RGBtoYIQConversionMatrix[3] * R + RGBtoYIQConversionMatrix[4] * G + RGBtoYIQConversionMatrix[5] * B;
-            Qsig.signal[pos] = RGBtoYIQConversionMatrix[6] * R + RGBtoYIQConversionMatrix[7] * G + RGBtoYIQConversionMatrix[8] * B;
-            pos++;
+            currentScanline = interlaced ? (i * 2 + interlaceField) % bcParams->videoScanlines : i;
+            for (int j = 0; j < activeSignalStarts[i]; j++) //Front porch, ignore sync signal because we don't see its results
+            {
+                Ysig.signal[pos] = 0.0f;
+                Isig.signal[pos] = 0.0f;
+                Qsig.signal[pos] = 0.0f;
+                pos++;
+            }
+            ReadComponentScanline(imgdat, currentScanline, Ysig.signal + pos, Isig.signal + pos, Qsig.signal + pos); //Active signal
+            pos += w;
+            while (pos < boundaryPoints[i + 1]) //Back porch, ignore sync signal because we don't see its results
+            {
+                Ysig.signal[pos] = 0.0f;
+                Isig.signal[pos] = 0.0f;
+                Qsig.signal[pos] = 0.0f;
+                pos++;
+            }
         }
-        while (pos < boundaryPoints[i + 1]) //Back porch, ignore sync signal because we don't see its results
-        {
-            Ysig.signal[pos] = 0.0f;
-            Isig.signal[pos] = 0.0f;
-            Qsig.signal[pos] = 0.0f;
-            pos++;
-        }
-    }
 
-    //Prefilter signals
-    SignalPack filtYsig = ApplyFIRFilter(Ysig, lumaprefir);
-    SignalPack filtIsig = ApplyFIRFilter(Isig, iprefir);
-    SignalPack filtQsig = ApplyFIRFilter(Qsig, qprefir);
+        Ysig = ContinueStream(Ysig, Streams::LumaPreStream);
+        Isig = ContinueStream(Isig, Streams::IPreStream);
+        Qsig = ContinueStream(Qsig, Streams::QPreStream);
+        prefiltered[0] = useIIR ? ApplyIIRFilter(Ysig, lumapreiir) : ApplyFIRFilter(Ysig, lumaprefir);
+        prefiltered[1] = useIIR ? ApplyIIRFilter(Isig, ipreiir) : ApplyFIRFilter(Isig, iprefir);
+        prefiltered[2] = useIIR ? ApplyIIRFilter(Qsig, qpreiir) : ApplyFIRFilter(Qsig, qprefir);
+        AdvanceStream(Ysig, Streams::LumaPreStream);
+        AdvanceStream(Isig, Streams::IPreStream);
+        AdvanceStream(Qsig, Streams::QPreStream);
+        KeepPrefiltered(field, prefiltered, 3);
+        FreeSignal(Ysig.signal);
+        FreeSignal(Isig.signal);
+        FreeSignal(Qsig.signal);
+    }
+    SignalPack filtYsig = prefiltered[0];
+    SignalPack filtIsig = prefiltered[1];
+    SignalPack filtQsig = prefiltered[2];
     double fieldPhaseAdv = fmod((field % 2500) * carrierAngFreq * bcParams->frameTime + chromaPhase, 2.0 * M_PI);
-    //Composite component signals
-    for (int i = 0; i < signalLen; i++)
+    //Composite component signals, a scanline at a time so the phase stays small
+    #pragma omp parallel for
+    for (int i = 0; i < fieldScanlines; i++)
     {
-        double time = i * sampleTime;
-        signalOut[i] = filtYsig.signal[i] + filtQsig.signal[i] * sin(carrierAngFreq * time + fieldPhaseAdv) + filtIsig.signal[i] * cos(carrierAngFreq * time + fieldPhaseAdv); //Add chroma via QAM
+        int lineStart = boundaryPoints[i];
+        double linePhase = fmod(carrierAngFreq * (lineStart * sampleTime) + fieldPhaseAdv, 2.0 * M_PI);
+        ModulateQAM(precision, filtYsig.signal + lineStart, filtQsig.signal + lineStart, filtIsig.signal + lineStart, signalOut + lineStart, boundaryPoints[i + 1] - lineStart, linePhase, carrierAngFreq * sampleTime, 1.0); //Add chroma via QAM
     }
 
-    delete[] Ysig.signal;
-    delete[] Isig.signal;
-    delete[] Qsig.signal;
-    delete[] filtYsig.signal;
-    delete[] filtIsig.signal;
-    delete[] filtQsig.signal;
-
-    return { signalOut, signalLen };
+    return { signalOut, signalLen, nullptr };
 }
 
-FrameData NTSCSystem::Decode(SignalPack signal, int field, double crosstalk)
+void NTSCSystem::Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame)
 {
     double realActiveTime = bcParams->activeTime;
     double realScanlineTime = bcParams->scanlineTime;
-    double realFrameTime = (interlaced ? 2.0 : 1.0) / bcParams->framerate;
-    int R = 0;
-    int G = 0;
-    int B = 0;
-    double Y = 0.0;
-    double Q = 0.0;
-    double I = 0.0;
-    int pos = 0;
-    int posdel = 0;
-    double sigNum = 0.0;
     double blendStr = 1.0 - crosstalk;
-    double c = cos(chromaPhase);
-    double s = sin(chromaPhase);
-
     double carrierAngFreq = bcParams->carrierAngFreq;
-    
-    SignalPack QSignal = ApplyFIRFilterCrosstalkShift(signal, qfir, crosstalk, sampleTime, carrierAngFreq);
-    SignalPack ISignal = ApplyFIRFilterCrosstalkShift(signal, ifir, crosstalk, sampleTime, carrierAngFreq);
-    SignalPack newSignal = ApplyFIRFilter(signal, mainfir);
-
-    //Extract QAM colour signals
     double fieldPhaseAdv = fmod((field % 2500) * carrierAngFreq * bcParams->frameTime + chromaPhase, 2.0 * M_PI);
-    for (int i = 0; i < fieldScanlines; i++)
+    int len = signal.len;
+    jitGen->Seek((uint64_t)field * fieldScanlines); //Each field's noise depends only on its number, so fields can be decoded in any order
+    jitGen->Generate(fieldScanlines, jitterTrack);
+    phNoiseGen->Seek((uint64_t)field * fieldScanlines);
+    phNoiseGen->Generate(fieldScanlines, phaseTrack);
+
+    for (int i = 0; i < fieldScanlines; i++) //Where the active signal starts
+    {
+        activeSignalStarts[i] = (int)((((double)i * (double)len) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * activeWidth);
+    }
+    SetScanlineJitterLimit(activeSignalStarts, fieldScanlines, len);
+
+    signal = ContinueStream(signal, Streams::CompositeStream);
+    if (combMode == CombFilterModes::CombOff && !useIIR)
     {
-        double phOffs = phNoiseGen->GenNoise();
-        double phaseAdv = fmod(phOffs + fieldPhaseAdv, 2.0 * M_PI);
-        while (pos < boundaryPoints[i + 1])
+        //Every stage here only looks a filter length ahead, so the whole chain can be run a band of scanlines at a time instead of a stage at a time over the whole field
+        FIRFilter qShiftfir = MakeMixedFIRFilter(qfir, 1.0 - crosstalk, crosstalk, true, sampleTime, carrierAngFreq);
+        FIRFilter iShiftfir = MakeMixedFIRFilter(ifir, 1.0 - crosstalk, crosstalk, true, sampleTime, carrierAngFreq);
+        FIRFilter notchShiftfir = MakeMixedFIRFilter(ifir, crosstalk - 1.0, 1.0, true, sampleTime, carrierAngFreq);
+        FIRFilter qCrosstalkfir = MakeMixedFIRFilter(qfir, 1.0 - crosstalk, crosstalk, true, 0.0, 0.0);
+        FIRFilter iCrosstalkfir = MakeMixedFIRFilter(ifir, 1.0 - crosstalk, crosstalk, true, 0.0, 0.0);
+        SignalPack QSignal = { AllocSignal(len), len, streamHistories[Streams::QStream] };
+        SignalPack ISignal = { AllocSignal(len), len, streamHistories[Streams::IStream] };
+        SignalPack lumaSignal = { AllocSignal(len), len, streamHistories[Streams::LumaStream] };
+        float* finalSignal = AllocSignal(len);
+        float* finalQSignal = AllocSignal(len);
+        float* finalISignal = AllocSignal(len);
+
+        int inDone = 0;
+        int lumaDone = 0;
+        int qDone = 0;
+        int iDone = 0;
+        int demodLines = 0;
+        int outLines = 0;
+        for (int band = 1; outLines < fieldScanlines; band++)
         {
-            double time = pos * sampleTime;
-            QSignal.signal[pos] = QSignal.signal[pos] * sin(carrierAngFreq * time + phaseAdv) * 2.0;
-            ISignal.signal[pos] = ISignal.signal[pos] * cos(carrierAngFreq * time + phaseAdv) * 2.0;
-            pos++;
+            int inEnd = boundaryPoints[band * STREAM_BAND_LINES < fieldScanlines ? band * STREAM_BAND_LINES : fieldScanlines];
+            ApplyFIRFilterRange(signal, qShiftfir, QSignal.signal, inDone, inEnd);
+            ApplyFIRFilterRange(signal, iShiftfir, ISignal.signal, inDone, inEnd);
+            ApplyFIRFilterRange(signal, mainfir, lumaSignal.signal, inDone, inEnd);
+            inDone = inEnd;
+
+            int lumaEnd = GetBandFrontier(inDone, len, notchShiftfir);
+            ApplyFIRFilterRange(lumaSignal, notchShiftfir, finalSignal, lumaDone, lumaEnd);
+            lumaDone = lumaEnd;
+
+            while (demodLines < fieldScanlines && boundaryPoints[demodLines + 1] <= inDone) DemodulateScanline(demodLines++, QSignal.signal, ISignal.signal, fieldPhaseAdv);
+            int qEnd = GetBandFrontier(boundaryPoints[demodLines], len, qCrosstalkfir);
+            int iEnd = GetBandFrontier(boundaryPoints[demodLines], len, iCrosstalkfir);
+            ApplyFIRFilterRange(QSignal, qCrosstalkfir, finalQSignal, qDone, qEnd);
+            ApplyFIRFilterRange(ISignal, iCrosstalkfir, finalISignal, iDone, iEnd);
+            qDone = qEnd;
+            iDone = iEnd;
+
+            int ready = lumaDone < qDone ? lumaDone : qDone;
+            if (iDone < ready) ready = iDone;
+            while (outLines < fieldScanlines)
+            {
+                int lineEnd = activeSignalStarts[outLines] + activeWidth + scanlineJitterLimit;
+                if (lineEnd > len) lineEnd = len;
+                if (lineEnd > ready) break;
+                OutputScanline(outLines++, finalSignal, finalISignal, finalQSignal, frame, field);
+            }
         }
-    }
 
-    SignalPack finalSignal = ApplyFIRFilterNotchCrosstalkShift(newSignal, ifir, crosstalk, sampleTime, carrierAngFreq);
-    SignalPack finalQSignal = ApplyFIRFilterCrosstalk(QSignal, qfir, crosstalk);
-    SignalPack finalISignal = ApplyFIRFilterCrosstalk(ISignal, ifir, crosstalk);
+        AdvanceStream(lumaSignal, Streams::LumaStream);
+        AdvanceStream(signal, Streams::CompositeStream);
+        AdvanceStream(QSignal, Streams::QStream);
+        AdvanceStream(ISignal, Streams::IStream);
+        FreeMixedFIRFilter(qShiftfir);
+        FreeMixedFIRFilter(iShiftfir);
+        FreeMixedFIRFilter(notchShiftfir);
+        FreeMixedFIRFilter(qCrosstalkfir);
+        FreeMixedFIRFilter(iCrosstalkfir);
+        FreeSignal(QSignal.signal);
+        FreeSignal(ISignal.signal);
+        FreeSignal(lumaSignal.signal);
+        FreeSignal(finalSignal);
+        FreeSignal(finalQSignal);
+        FreeSignal(finalISignal);
+        return;
+    }
 
-    FrameData writeToSurface = { new int[activeWidth * fieldScanlines], activeWidth, fieldScanlines };
+    //The IIR filters run backwards over the whole field, and the comb filters need all of it stored, so these go a stage at a time
+    SignalPack QSignal;
+    SignalPack ISignal;
+    SignalPack finalSignal;
+    if (combMode == CombFilterModes::CombOff)
+    {
+        QSignal = ApplyIIRFilterCrosstalkShift(signal, qiir, crosstalk, sampleTime, carrierAngFreq);
+        ISignal = ApplyIIRFilterCrosstalkShift(signal, iiir, crosstalk, sampleTime, carrierAngFreq);
+        SignalPack newSignal = ContinueStream(ApplyIIRFilter(signal, mainiir), Streams::LumaStream);
+        finalSignal = ApplyIIRFilterNotchCrosstalkShift(newSignal, iiir, crosstalk, sampleTime, carrierAngFreq);
+        AdvanceStream(newSignal, Streams::LumaStream);
+        FreeSignal(newSignal.signal);
+    }
+    else
+    {
+        //Comb filters split luma and chroma using the scanlines around, instead of long bandpass and notch filters
+        QSignal = CombFilterChroma(signal, field);
+        ISignal = { AllocSignal(len), len, nullptr };
+        SignalPack lumaSignal = { AllocSignal(len), len, streamHistories[Streams::LumaStream] };
+        for (int i = 0; i < len; i++)
+        {
+            lumaSignal.signal[i] = signal.signal[i] - blendStr * QSignal.signal[i];
+            QSignal.signal[i] = blendStr * QSignal.signal[i] + crosstalk * signal.signal[i];
+            ISignal.signal[i] = QSignal.signal[i];
+        }
+        finalSignal = useIIR ? ApplyIIRFilter(lumaSignal, mainiir) : ApplyFIRFilter(lumaSignal, mainfir);
+        AdvanceStream(lumaSignal, Streams::LumaStream);
+        FreeSignal(lumaSignal.signal);
+    }
+    AdvanceStream(signal, Streams::CompositeStream);
 
-    for (int i = 0; i < fieldScanlines; i++) //Where the active signal starts
+    for (int i = 0; i < fieldScanlines; i++)
     {
-        activeSignalStarts[i] = (int)((((double)i * (double)signal.len) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * activeWidth);
+        DemodulateScanline(i, QSignal.signal, ISignal.signal, fieldPhaseAdv);
     }
 
-    int* surfaceColours = writeToSurface.image;
-    int curjit = 0;
-    int finCol = 0;
-    double dR = 0.0;
-    double dG = 0.0;
-    double dB = 0.0;
-    //Write decoded signals to our frame (NTSC is very simple so we don't have to do any more than filtering and demodulation)
+    QSignal = ContinueStream(QSignal, Streams::QStream);
+    ISignal = ContinueStream(ISignal, Streams::IStream);
+    SignalPack finalQSignal = useIIR ? ApplyIIRFilterCrosstalk(QSignal, qiir, crosstalk) : ApplyFIRFilterCrosstalk(QSignal, qfir, crosstalk);
+    SignalPack finalISignal = useIIR ? ApplyIIRFilterCrosstalk(ISignal, iiir, crosstalk) : ApplyFIRFilterCrosstalk(ISignal, ifir, crosstalk);
+    AdvanceStream(QSignal, Streams::QStream);
+    AdvanceStream(ISignal, Streams::IStream);
+
     for (int i = 0; i < fieldScanlines; i++)
     {
-        curjit = (int)jitGen->GenNoise();
-        if (curjit > 100) curjit = 100;
-        if (curjit < -100) curjit = -100; //Limit jitter distance to prevent buffer overflow
-        pos = activeSignalStarts[i] + curjit;
-        for (int j = 0; j < writeToSurface.width; j++) //Decode active signal region only
-        {
-            Y = finalSignal.signal[pos];
-            Q = finalQSignal.signal[pos];
-            I = finalISignal.signal[pos];
-            dR = pow(YIQtoRGBConversionMatrix[0] * Y + YIQtoRGBConversionMatrix[1] * I + YIQtoRGBConversionMatrix[2] * Q, 2.2);
-            dG = pow(YIQtoRGBConversionMatrix[3] * Y + YIQtoRGBConversionMatrix[4] * I + YIQtoRGBConversionMatrix[5] * Q, 2.2);
-            dB = pow(YIQtoRGBConversionMatrix[6] * Y + YIQtoRGBConversionMatrix[7] * I + YIQtoRGBConversionMatrix[8] * Q, 2.2);
-            R = (int)(CD_CLAMP(SRGBInverseGammaTransform(dR), 0.0, 1.0) * 255.0);
-            G = (int)(CD_CLAMP(SRGBInverseGammaTransform(dG), 0.0, 1.0) * 255.0);
-            B = (int)(CD_CLAMP(SRGBInverseGammaTransform(dB), 0.0, 1.0) * 255.0);
-            finCol = 0xFF000000;
-            finCol |= R << 16;
-            finCol |= G << 8;
-            finCol |= B;
-            surfaceColours[i * writeToSurface.width + j] = finCol;
-            pos++;
-        }
+        OutputScanline(i, finalSignal.signal, finalISignal.signal, finalQSignal.signal, frame, field);
     }
 
-    delete[] QSignal.signal;
-    delete[] ISignal.signal;
-    delete[] newSignal.signal;
-    delete[] finalSignal.signal;
-    delete[] finalQSignal.signal;
-    delete[] finalISignal.signal;
+    FreeSignal(QSignal.signal);
+    FreeSignal(ISignal.signal);
+    FreeSignal(finalSignal.signal);
+    FreeSignal(finalQSignal.signal);
+    FreeSignal(finalISignal.signal);
+}
+
+//Extract QAM colour signals, in place
+void NTSCSystem::DemodulateScanline(int line, float* QSignal, float* ISignal, double fieldPhaseAdv)
+{
+    double carrierAngFreq = bcParams->carrierAngFreq;
+    double phOffs = phaseTrack[line];
+    double phaseAdv = fmod(phOffs + fieldPhaseAdv, 2.0 * M_PI);
+    int lineStart = boundaryPoints[line];
+    double linePhase = fmod(carrierAngFreq * (lineStart * sampleTime) + phaseAdv, 2.0 * M_PI);
+    DemodulateQAM(precision, QSignal + lineStart, ISignal + lineStart, QSignal + lineStart, ISignal + lineStart, boundaryPoints[line + 1] - lineStart, linePhase, carrierAngFreq * sampleTime, 2.0, 2.0);
+}
 
-    return writeToSurface;
+//Write a decoded scanline to our frame (NTSC is very simple so we don't have to do any more than filtering and demodulation)
+void NTSCSystem::OutputScanline(int line, const float* finalSignal, const float* finalISignal, const float* finalQSignal, OutputFrame frame, int field)
+{
+    int curjit = (int)jitterTrack[line];
+    if (curjit > scanlineJitterLimit) curjit = scanlineJitterLimit;
+    if (curjit < -scanlineJitterLimit) curjit = -scanlineJitterLimit; //Limit jitter distance to prevent buffer overflow
+    int pos = activeSignalStarts[line] + curjit;
+    DecodeScanline(finalSignal + pos, finalISignal + pos, finalQSignal + pos, activeWidth, frame, interlaced ? line * 2 + (field & 1) : line);
 }
 
 SignalPack NTSCSystem::AddText(SignalPack signal, const char* text, double x, int y, bool yRelativeToBottom)
@@ -279,7 +358,7 @@ SignalPack NTSCSystem::AddText(SignalPack signal, const char* text, double x, in
 	if (actualStartY < 0) actualStartY = 0;
 	double realActiveTime = bcParams->activeTime;
 	double realScanlineTime = 1.0 / (double)(fieldScanlines * bcParams->framerate);
-	double scanlineLength = FIXEDWIDTH * (realScanlineTime/realActiveTime);
+	double scanlineLength = activeWidth * (realScanlineTime/realActiveTime);
 	double scanlineIncPerSample = 1.0 / (scanlineLength * VHS_FONT_GLYPH_WIDTH);
 	float* sig = signal.signal;
 	while (curCh != 0)
@@ -25,17 +25,30 @@ constexpr double chromaPhase = 33.0 * (M_PI / 180.0);
 class NTSCSystem : public ColourSystem
 {
 public:
-    NTSCSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent);
+    NTSCSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, CombFilterModes comb, bool iirFilters, QualityTiers quality, int width);
 
-    virtual SignalPack Encode(FrameData imgdat, int field) override;
-    virtual FrameData Decode(SignalPack signal, int field, double crosstalk) override;
+    using ColourSystem::Encode;
+    virtual SignalPack Encode(ComponentFrame imgdat, int field, float* output) override;
+    virtual void Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame) override;
     virtual SignalPack AddText(SignalPack signal, const char* text, double x, int y, bool yRelativeToBottom) override;
 private:
+    enum Streams
+    {
+        LumaPreStream,
+        IPreStream,
+        QPreStream,
+        CompositeStream,
+        LumaStream,
+        IStream,
+        QStream
+    };
+
     MultiOctaveNoiseGen* jitGen;
     MultiOctaveNoiseGen* phNoiseGen;
+    double* jitterTrack; //This field's noise, one per scanline
+    double* phaseTrack;
     bool interlaced;
     int fieldScanlines;
-    int activeWidth;
     int* boundaryPoints;
     int* activeSignalStarts;
     double sampleRate;
@@ -46,4 +59,14 @@ private:
     FIRFilter lumaprefir;
     FIRFilter qprefir;
     FIRFilter iprefir;
+    bool useIIR;
+    IIRFilter mainiir;
+    IIRFilter qiir;
+    IIRFilter iiir;
+    IIRFilter lumapreiir;
+    IIRFilter ipreiir;
+    IIRFilter qpreiir;
+
+    void DemodulateScanline(int line, float* QSignal, float* ISignal, double fieldPhaseAdv);
+    void OutputScanline(int line, const float* finalSignal, const float* finalISignal, const float* finalQSignal, OutputFrame frame, int field);
 };
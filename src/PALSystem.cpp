@@ -9,7 +9,7 @@
 #include "PALSystem.h"
 #include "VHSFont.h"
 
-PALSystem::PALSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent)
+PALSystem::PALSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, CombFilterModes comb, bool iirFilters, QualityTiers quality, int width)
 {
 	switch (sys)
 	{
@@ -51,50 +51,56 @@ PALSystem::PALSystem(BroadcastSystems sys, bool interlace, double resonance, dou
 
 	RGBtoYCCConversionMatrix = RGBtoYUVConversionMatrix;
 	YCCtoRGBConversionMatrix = YUVtoRGBConversionMatrix;
+	SetupEncodeGamma(2.8);
+	SetupDecodeGamma(2.8);
 
 	interlaced = interlace;
-	activeWidth = FIXEDWIDTH;
+	useIIR = iirFilters;
+	const QualityProfile* profile = GetQualityProfile(quality);
+	SetActiveWidth(width > 0 ? width : GetDefaultActiveWidth(bcParams, profile->sampleRateMargin));
 	fieldScanlines = interlace ? bcParams->videoScanlines / 2 : bcParams->videoScanlines;
+	signalLength = (int)(activeWidth * fieldScanlines * (bcParams->scanlineTime / bcParams->activeTime));
 	boundaryPoints = new int[fieldScanlines + 1]; //Boundaries of the scanline signals
 	activeSignalStarts = new int[fieldScanlines]; //Start points of the active parts
 	sampleRate = activeWidth / bcParams->activeTime; //Correction for the fact that the signal we've created only has active scanlines.
 	sampleTime = bcParams->activeTime / (double)activeWidth;
+	SetKernelPrecision(profile->precision, bcParams->carrierAngFreq * sampleTime);
 	double realScanlineTime = 1.0 / (double)(fieldScanlines * bcParams->framerate);
 	int signalLen = (int)(activeWidth * fieldScanlines * (realScanlineTime / bcParams->activeTime)); //To get a good analogue feel, we must limit the vertical resolution; the horizontal resolution will be limited as we decode the distorted signal.
 
 	std::cout << "Creating decode filters..." << std::endl;
 
-	mainfir = MakeFIRFilter(sampleRate, 256, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance);
-	colfir = MakeFIRFilter(sampleRate, 256, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance);
+	if (useIIR) mainiir = MakeIIRFilter(sampleRate, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance);
+	else mainfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance, profile->filterTolerance);
+	if (useIIR) coliir = MakeIIRFilter(sampleRate, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance);
+	else colfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance, profile->filterTolerance);
 
 	std::cout << "Creating prefilters..." << std::endl;
 
-	lumaprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE);
-	chromaprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE);
+	if (useIIR) lumapreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE);
+	else lumaprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
+	if (useIIR) chromapreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE);
+	else chromaprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
 
 	USignal = new float[signalLen];
 	VSignal = new float[signalLen];
 	USignalPreAlt = new float[signalLen];
 	VSignalPreAlt = new float[signalLen];
 
-	jitGen = new MultiOctaveNoiseGen(11, 0.0, scanlineJitter * activeWidth, noiseExponent);
-	phNoiseGen = new MultiOctaveNoiseGen(11, 0.0, phaseNoise, noiseExponent);
+	SetupCombFilter(comb, activeWidth * (bcParams->scanlineTime / bcParams->activeTime), sampleTime, signalLen, true);
+
+	jitGen = new MultiOctaveNoiseGen(11, 0.0, scanlineJitter * activeWidth, noiseExponent, NoiseStreams::NoiseStreamJitter);
+	phNoiseGen = new MultiOctaveNoiseGen(11, 0.0, phaseNoise, noiseExponent, NoiseStreams::NoiseStreamPhase);
+	jitterTrack = new double[fieldScanlines];
+	phaseTrack = new double[fieldScanlines];
 }
 
-SignalPack PALSystem::Encode(FrameData imgdat, int field)
+SignalPack PALSystem::Encode(ComponentFrame imgdat, int field, float* signalOut)
 {
 	double realActiveTime = bcParams->activeTime;
 	double realScanlineTime = bcParams->scanlineTime;
 	int signalLen = (int)(imgdat.width * fieldScanlines * (realScanlineTime/realActiveTime)); //To get a good analogue feel, we must limit the vertical resolution; the horizontal resolution will be limited as we decode the distorted signal.
-	float* signalOut = new float[signalLen];
-	double R = 0.0;
-	double G = 0.0;
-	double B = 0.0;
-	double Y = 0.0;
-	double U = 0.0;
-	double V = 0.0;
 	int pos = 0;
-	double phaseAlternate = 1.0; //Why this is called PAL in the first place
 	int remainingSync = 0;
 	double sampleTime = realActiveTime / (double)imgdat.width;
 
@@ -110,199 +116,247 @@ SignalPack PALSystem::Encode(FrameData imgdat, int field)
 		activeSignalStarts[i] = (int)((((double)i * (double)signalLen) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * imgdat.width) - boundaryPoints[i];
 	}
 
-	int* imgColours = imgdat.image;
 	int currentScanline;
 	double finSamp = 0.0;
 	int w = imgdat.width;
-	int col;
 	int interlaceField = field & 1;
 	double carrierAngFreq = bcParams->carrierAngFreq;
-	SignalPack Ysig = { new float[signalLen], signalLen };
-	SignalPack Usig = { new float[signalLen], signalLen };
-	SignalPack Vsig = { new float[signalLen], signalLen };
-	//Make component signals
-	for (int i = 0; i < fieldScanlines; i++) //Only generate active scanlines
+	//Prefilter signals, unless this picture has just been through them
+	const int prefilterStreams[3] = { Streams::LumaPreStream, Streams::UPreStream, Streams::VPreStream };
+	SignalPack prefiltered[3];
+	if (!ReusePrefiltered(imgdat.contentId, field, prefilterStreams, 3, prefiltered, 3))
 	{
-		currentScanline = interlaced ? (i * 2 + interlaceField) % bcParams->videoScanlines : i;
-		for (int j = 0; j < activeSignalStarts[i]; j++) //Front porch, ignore sync signal because we don't see its results
-		{
-			Ysig.signal[pos] = 0.0f;
-			Usig.signal[pos] = 0.0f;
-			Vsig.signal[pos] = 0.0f;
-			pos++;
-		}
-		for (int j = 0; j < w; j++) //Active signal
+		SignalPack Ysig = { AllocSignal(signalLen), signalLen, nullptr };
+		SignalPack Usig = { AllocSignal(signalLen), signalLen, nullptr };
+		SignalPack Vsig = { AllocSignal(signalLen), signalLen, nullptr };
+		//Make component signals
+		for (int i = 0; i < fieldScanlines; i++) //Only generate active scanlines
 		{
-			col = imgColours[currentScanline * w + j];
-			R = ((col & 0x00FF0000) >> 16) / 255.0;
-			G = ((col & 0x0000FF00) >> 8) / 255.0;
-			B = (col & 0x000000FF) / 255.0;
-			R = SRGBGammaTransform(R); //SRGB correction
-			G = SRGBGammaTransform(G);
-			B = SRGBGammaTransform(B);
-			R = pow(R, 1.0/2.8); //Gamma correction
-			G = pow(G, 1.0/2.8);
-			B = pow(B, 1.0/2.8);
-			Ysig.signal[pos] = RGBtoYUVConversionMatrix[0] * R + RGBtoYUVConversionMatrix[1] * G + RGBtoYUVConversionMatrix[2] * B; //Encode Y, U and V
-			Usig.signal[pos] = RGBtoYUVConversionMatrix[3] * R + RGBtoYUVConversionMatrix[4] * G + RGBtoYUVConversionMatrix[5] * B;
-			Vsig.signal[pos] = RGBtoYUVConversionMatrix[6] * R + RGBtoYUVConversionMatrix[7] * G + RGBtoYUVConversionMatrix[8] * B;
-			pos++;
-		}
-		while (pos < boundaryPoints[i + 1]) //Back porch, ignore sync signal because we don't see its results
-		{
-			Ysig.signal[pos] = 0.0f;
-			Usig.signal[pos] = 0.0f;
-			Vsig.signal[pos] = 0.0f;
-			pos++;
+			currentScanline = interlaced ? (i * 2 + interlaceField) % bcParams->videoScanlines : i;
+			for (int j = 0; j < activeSignalStarts[i]; j++) //Front porch, ignore sync signal because we don't see its results
+			{
+				Ysig.signal[pos] = 0.0f;
+				Usig.signal[pos] = 0.0f;
+				Vsig.signal[pos] = 0.0f;
+				pos++;
+			}
+			ReadComponentScanline(imgdat, currentScanline, Ysig.signal + pos, Usig.signal + pos, Vsig.signal + pos); //Active signal
+			pos += w;
+			while (pos < boundaryPoints[i + 1]) //Back porch, ignore sync signal because we don't see its results
+			{
+				Ysig.signal[pos] = 0.0f;
+				Usig.signal[pos] = 0.0f;
+				Vsig.signal[pos] = 0.0f;
+				pos++;
+			}
 		}
-	}
 
-	//Prefilter signals
-	SignalPack filtYsig = ApplyFIRFilter(Ysig, lumaprefir);
-	SignalPack filtUsig = ApplyFIRFilter(Usig, chromaprefir);
-	SignalPack filtVsig = ApplyFIRFilter(Vsig, chromaprefir);
-	pos = 0;
+		Ysig = ContinueStream(Ysig, Streams::LumaPreStream);
+		Usig = ContinueStream(Usig, Streams::UPreStream);
+		Vsig = ContinueStream(Vsig, Streams::VPreStream);
+		prefiltered[0] = useIIR ? ApplyIIRFilter(Ysig, lumapreiir) : ApplyFIRFilter(Ysig, lumaprefir);
+		prefiltered[1] = useIIR ? ApplyIIRFilter(Usig, chromapreiir) : ApplyFIRFilter(Usig, chromaprefir);
+		prefiltered[2] = useIIR ? ApplyIIRFilter(Vsig, chromapreiir) : ApplyFIRFilter(Vsig, chromaprefir);
+		AdvanceStream(Ysig, Streams::LumaPreStream);
+		AdvanceStream(Usig, Streams::UPreStream);
+		AdvanceStream(Vsig, Streams::VPreStream);
+		KeepPrefiltered(field, prefiltered, 3);
+		FreeSignal(Ysig.signal);
+		FreeSignal(Usig.signal);
+		FreeSignal(Vsig.signal);
+	}
+	SignalPack filtYsig = prefiltered[0];
+	SignalPack filtUsig = prefiltered[1];
+	SignalPack filtVsig = prefiltered[2];
 	double frameAlternation = field & 2 ? -1.0 : 1.0;
 	double fieldPhaseAdv = fmod((field % 2500) * carrierAngFreq * bcParams->frameTime, 2.0 * M_PI);
 	//Composite component signals
+	#pragma omp parallel for
 	for (int i = 0; i < fieldScanlines; i++)
 	{
-		if ((i % 2) == 1) //Do phase alternation
-		{
-			phaseAlternate = -frameAlternation;
-		}
-		else phaseAlternate = frameAlternation;
-		double time = 0.0;
-		while (pos < boundaryPoints[i + 1])
-		{
-			double time = pos * sampleTime;
-			signalOut[pos] = filtYsig.signal[pos] + filtUsig.signal[pos] * sin(carrierAngFreq * time + fieldPhaseAdv) + phaseAlternate * filtVsig.signal[pos] * cos(carrierAngFreq * time + fieldPhaseAdv); //Add chroma via QAM
-			pos++;
-		}
+		double lineAlternate = (i % 2) == 1 ? -frameAlternation : frameAlternation; //Do phase alternation
+		int lineStart = boundaryPoints[i];
+		double linePhase = fmod(carrierAngFreq * (lineStart * sampleTime) + fieldPhaseAdv, 2.0 * M_PI);
+		ModulateQAM(precision, filtYsig.signal + lineStart, filtUsig.signal + lineStart, filtVsig.signal + lineStart, signalOut + lineStart, boundaryPoints[i + 1] - lineStart, linePhase, carrierAngFreq * sampleTime, lineAlternate); //Add chroma via QAM
 	}
 
-	delete[] Ysig.signal;
-	delete[] Usig.signal;
-	delete[] Vsig.signal;
-	delete[] filtYsig.signal;
-	delete[] filtUsig.signal;
-	delete[] filtVsig.signal;
-
-    return { signalOut, signalLen };
+    return { signalOut, signalLen, nullptr };
 }
 
-FrameData PALSystem::Decode(SignalPack signal, int field, double crosstalk)
+void PALSystem::Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame)
 {
     double realActiveTime = bcParams->activeTime;
     double realScanlineTime = bcParams->scanlineTime;
-    double realFrameTime = (interlaced ? 2.0 : 1.0) / bcParams->framerate;
-    int R = 0;
-    int G = 0;
-    int B = 0;
-    double Y = 0.0;
-    double U = 0.0;
-    double V = 0.0;
-    int pos = 0;
-    int posdel = 0;
-    double sigNum = 0.0;
     double blendStr = 1.0 - crosstalk;
     double sampleTime = realActiveTime / (double)activeWidth;
-    
-    SignalPack colsignal = ApplyFIRFilterCrosstalkShift(signal, colfir, crosstalk, sampleTime, bcParams->carrierAngFreq);
-    SignalPack newSignal = ApplyFIRFilter(signal, mainfir);
-
-	//Extract QAM colour signals
     double carrierAngFreq = bcParams->carrierAngFreq;
-	double fieldPhaseAdv = fmod((field % 2500) * carrierAngFreq * bcParams->frameTime, 2.0 * M_PI);
-	double frameAlternation = field & 2 ? -1.0 : 1.0;
-	for (int i = 0; i < fieldScanlines; i++)
-	{
-		double phOffs = phNoiseGen->GenNoise();
-		double phaseAdv = fmod(phOffs + fieldPhaseAdv, 2.0 * M_PI);
-		while (pos < boundaryPoints[i + 1])
-		{
-			double time = pos * sampleTime;
-			USignalPreAlt[pos] = colsignal.signal[pos] * sin(carrierAngFreq * time + phaseAdv) * 2.0;
-			VSignalPreAlt[pos] = frameAlternation * colsignal.signal[pos] * cos(carrierAngFreq * time + phaseAdv) * 2.0;
-			pos++;
-		}
-	}
-
-    SignalPack finalSignal = ApplyFIRFilterNotchCrosstalkShift(newSignal, colfir, crosstalk, sampleTime, carrierAngFreq);
-    SignalPack finalUSignal = ApplyFIRFilter({ USignalPreAlt, signal.len }, colfir);
-    SignalPack finalVSignal = ApplyFIRFilter({ VSignalPreAlt, signal.len }, colfir);
-
-    FrameData writeToSurface = { new int[activeWidth * fieldScanlines], activeWidth, fieldScanlines };
+    double fieldPhaseAdv = fmod((field % 2500) * carrierAngFreq * bcParams->frameTime, 2.0 * M_PI);
+    double frameAlternation = field & 2 ? -1.0 : 1.0;
+    int len = signal.len;
+    jitGen->Seek((uint64_t)field * fieldScanlines); //Each field's noise depends only on its number, so fields can be decoded in any order
+    jitGen->Generate(fieldScanlines, jitterTrack);
+    phNoiseGen->Seek((uint64_t)field * fieldScanlines);
+    phNoiseGen->Generate(fieldScanlines, phaseTrack);
 
     for (int i = 0; i < fieldScanlines; i++) //Where the active signal starts
     {
-        activeSignalStarts[i] = (int)((((double)i * (double)signal.len) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * activeWidth);
+        activeSignalStarts[i] = (int)((((double)i * (double)len) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * activeWidth);
+    }
+    SetScanlineJitterLimit(activeSignalStarts, fieldScanlines, len);
+
+    signal = ContinueStream(signal, Streams::CompositeStream);
+    if (combMode == CombFilterModes::CombOff && !useIIR)
+    {
+        //Every stage here only looks a filter length ahead, so the whole chain can be run a band of scanlines at a time instead of a stage at a time over the whole field
+        FIRFilter colShiftfir = MakeMixedFIRFilter(colfir, 1.0 - crosstalk, crosstalk, true, sampleTime, carrierAngFreq);
+        FIRFilter notchShiftfir = MakeMixedFIRFilter(colfir, crosstalk - 1.0, 1.0, true, sampleTime, carrierAngFreq);
+        float* colsignal = AllocSignal(len);
+        SignalPack lumaSignal = { AllocSignal(len), len, streamHistories[Streams::LumaStream] };
+        float* finalSignal = AllocSignal(len);
+        SignalPack USignalPack = ContinueStream({ USignalPreAlt, len, nullptr }, Streams::UStream);
+        SignalPack VSignalPack = ContinueStream({ VSignalPreAlt, len, nullptr }, Streams::VStream);
+        float* finalUSignal = AllocSignal(len);
+        float* finalVSignal = AllocSignal(len);
+
+        int inDone = 0;
+        int lumaDone = 0;
+        int chromaDone = 0;
+        int demodLines = 0;
+        int delayLines = 0;
+        int outLines = 0;
+        for (int band = 1; outLines < fieldScanlines; band++)
+        {
+            int inEnd = boundaryPoints[band * STREAM_BAND_LINES < fieldScanlines ? band * STREAM_BAND_LINES : fieldScanlines];
+            ApplyFIRFilterRange(signal, colShiftfir, colsignal, inDone, inEnd);
+            ApplyFIRFilterRange(signal, mainfir, lumaSignal.signal, inDone, inEnd);
+            inDone = inEnd;
+
+            int lumaEnd = GetBandFrontier(inDone, len, notchShiftfir);
+            ApplyFIRFilterRange(lumaSignal, notchShiftfir, finalSignal, lumaDone, lumaEnd);
+            lumaDone = lumaEnd;
+
+            while (demodLines < fieldScanlines && boundaryPoints[demodLines + 1] <= inDone) DemodulateScanline(demodLines++, colsignal, fieldPhaseAdv, frameAlternation, sampleTime);
+            int chromaEnd = GetBandFrontier(boundaryPoints[demodLines], len, colfir);
+            ApplyFIRFilterRange(USignalPack, colfir, finalUSignal, chromaDone, chromaEnd);
+            ApplyFIRFilterRange(VSignalPack, colfir, finalVSignal, chromaDone, chromaEnd);
+            chromaDone = chromaEnd;
+
+            while (delayLines < fieldScanlines && activeSignalStarts[delayLines] + activeWidth <= chromaDone) DelayLineScanline(delayLines++, finalUSignal, finalVSignal);
+            while (outLines < fieldScanlines && (outLines + 1 < delayLines || delayLines == fieldScanlines)) //Jitter can reach into the next scanline's chroma
+            {
+                int lineEnd = activeSignalStarts[outLines] + activeWidth + scanlineJitterLimit;
+                if (lineEnd > len) lineEnd = len;
+                if (lineEnd > lumaDone) break;
+                OutputScanline(outLines++, finalSignal, frame, field);
+            }
+        }
+
+        AdvanceStream(lumaSignal, Streams::LumaStream);
+        AdvanceStream(signal, Streams::CompositeStream);
+        AdvanceStream(USignalPack, Streams::UStream);
+        AdvanceStream(VSignalPack, Streams::VStream);
+        FreeMixedFIRFilter(colShiftfir);
+        FreeMixedFIRFilter(notchShiftfir);
+        FreeSignal(colsignal);
+        FreeSignal(lumaSignal.signal);
+        FreeSignal(finalSignal);
+        FreeSignal(finalUSignal);
+        FreeSignal(finalVSignal);
+        return;
     }
 
-	//Account for phase-alternation
-    double alt = 0.0;
-    pos = activeSignalStarts[0];
-    for (int j = 0; j < writeToSurface.width; j++) //We assume the chroma signal in all blanking periods is zero
+    //The IIR filters run backwards over the whole field, and the comb filters need all of it stored, so these go a stage at a time
+    SignalPack colsignal;
+    SignalPack finalSignal;
+    if (combMode == CombFilterModes::CombOff)
     {
-        USignal[pos] = finalUSignal.signal[pos] / 2.0;
-        VSignal[pos] = finalVSignal.signal[pos] / 2.0;
-        pos++;
-        posdel++;
+        colsignal = ApplyIIRFilterCrosstalkShift(signal, coliir, crosstalk, sampleTime, carrierAngFreq);
+        SignalPack newSignal = ContinueStream(ApplyIIRFilter(signal, mainiir), Streams::LumaStream);
+        finalSignal = ApplyIIRFilterNotchCrosstalkShift(newSignal, coliir, crosstalk, sampleTime, carrierAngFreq);
+        AdvanceStream(newSignal, Streams::LumaStream);
+        FreeSignal(newSignal.signal);
     }
-    for (int i = 1; i < fieldScanlines; i++) //Simulate a delay line
+    else
     {
-        pos = activeSignalStarts[i];
-        posdel = activeSignalStarts[i - 1];
-        alt = (i % 2) == 0 ? -1.0 : 1.0;
-        for (int j = 0; j < writeToSurface.width; j++)
+        //Comb filters split luma and chroma using the scanlines around, instead of long bandpass and notch filters
+        colsignal = CombFilterChroma(signal, field);
+        SignalPack lumaSignal = { AllocSignal(len), len, streamHistories[Streams::LumaStream] };
+        for (int i = 0; i < len; i++)
         {
-            USignal[pos] = (finalUSignal.signal[posdel] + finalUSignal.signal[pos]) / 2.0;
-            VSignal[pos] = alt * (finalVSignal.signal[posdel] - finalVSignal.signal[pos]) / 2.0;
-            pos++;
-            posdel++;
+            lumaSignal.signal[i] = signal.signal[i] - blendStr * colsignal.signal[i];
+            colsignal.signal[i] = blendStr * colsignal.signal[i] + crosstalk * signal.signal[i];
         }
+        finalSignal = useIIR ? ApplyIIRFilter(lumaSignal, mainiir) : ApplyFIRFilter(lumaSignal, mainfir);
+        AdvanceStream(lumaSignal, Streams::LumaStream);
+        FreeSignal(lumaSignal.signal);
     }
+    AdvanceStream(signal, Streams::CompositeStream);
 
-    int* surfaceColours = writeToSurface.image;
-    int curjit = 0;
-	int finCol = 0;
-	double dR = 0.0;
-	double dG = 0.0;
-	double dB = 0.0;
-	//Write decoded signals to our frame
     for (int i = 0; i < fieldScanlines; i++)
     {
-		curjit = (int)jitGen->GenNoise();
-		if (curjit > 100) curjit = 100;
-		if (curjit < -100) curjit = -100; //Limit jitter distance to prevent buffer overflow
-        pos = activeSignalStarts[i] + curjit;
-        for (int j = 0; j < writeToSurface.width; j++) //Decode active signal region only
+        DemodulateScanline(i, colsignal.signal, fieldPhaseAdv, frameAlternation, sampleTime);
+    }
+
+    SignalPack USignalPack = ContinueStream({ USignalPreAlt, len, nullptr }, Streams::UStream);
+    SignalPack VSignalPack = ContinueStream({ VSignalPreAlt, len, nullptr }, Streams::VStream);
+    SignalPack finalUSignal = useIIR ? ApplyIIRFilter(USignalPack, coliir) : ApplyFIRFilter(USignalPack, colfir);
+    SignalPack finalVSignal = useIIR ? ApplyIIRFilter(VSignalPack, coliir) : ApplyFIRFilter(VSignalPack, colfir);
+    AdvanceStream(USignalPack, Streams::UStream);
+    AdvanceStream(VSignalPack, Streams::VStream);
+
+    for (int i = 0; i < fieldScanlines; i++)
+    {
+        DelayLineScanline(i, finalUSignal.signal, finalVSignal.signal);
+        OutputScanline(i, finalSignal.signal, frame, field);
+    }
+
+	FreeSignal(colsignal.signal);
+	FreeSignal(finalSignal.signal);
+	FreeSignal(finalUSignal.signal);
+	FreeSignal(finalVSignal.signal);
+}
+
+//Extract QAM colour signals
+void PALSystem::DemodulateScanline(int line, const float* colsignal, double fieldPhaseAdv, double frameAlternation, double sampleTime)
+{
+	double carrierAngFreq = bcParams->carrierAngFreq;
+	double phOffs = phaseTrack[line];
+	double phaseAdv = fmod(phOffs + fieldPhaseAdv, 2.0 * M_PI);
+	int lineStart = boundaryPoints[line];
+	double linePhase = fmod(carrierAngFreq * (lineStart * sampleTime) + phaseAdv, 2.0 * M_PI);
+	DemodulateQAM(precision, colsignal + lineStart, colsignal + lineStart, USignalPreAlt + lineStart, VSignalPreAlt + lineStart, boundaryPoints[line + 1] - lineStart, linePhase, carrierAngFreq * sampleTime, 2.0, 2.0 * frameAlternation);
+}
+
+//Account for phase-alternation by simulating a delay line, which needs the scanline before to be filtered already
+void PALSystem::DelayLineScanline(int line, const float* finalUSignal, const float* finalVSignal)
+{
+    int pos = activeSignalStarts[line];
+    if (line == 0)
+    {
+        for (int j = 0; j < activeWidth; j++) //We assume the chroma signal in all blanking periods is zero
         {
-            Y = finalSignal.signal[pos];
-            U = USignal[pos];
-            V = VSignal[pos];
-			dR = pow(YUVtoRGBConversionMatrix[0] * Y + YUVtoRGBConversionMatrix[2] * V, 2.8);
-			dG = pow(YUVtoRGBConversionMatrix[3] * Y + YUVtoRGBConversionMatrix[4] * U + YUVtoRGBConversionMatrix[5] * V, 2.8);
-			dB = pow(YUVtoRGBConversionMatrix[6] * Y + YUVtoRGBConversionMatrix[7] * U, 2.8);
-            R = (int)(CD_CLAMP(SRGBInverseGammaTransform(dR), 0.0, 1.0) * 255.0);
-            G = (int)(CD_CLAMP(SRGBInverseGammaTransform(dG), 0.0, 1.0) * 255.0);
-            B = (int)(CD_CLAMP(SRGBInverseGammaTransform(dB), 0.0, 1.0) * 255.0);
-			finCol = 0xFF000000;
-			finCol |= R << 16;
-			finCol |= G << 8;
-			finCol |= B;
-            surfaceColours[i * writeToSurface.width + j] = finCol;
-            pos++;
+            USignal[pos + j] = finalUSignal[pos + j] / 2.0;
+            VSignal[pos + j] = finalVSignal[pos + j] / 2.0;
         }
+        return;
     }
+    int posdel = activeSignalStarts[line - 1];
+    double alt = (line % 2) == 0 ? -1.0 : 1.0;
+    for (int j = 0; j < activeWidth; j++)
+    {
+        USignal[pos + j] = (finalUSignal[posdel + j] + finalUSignal[pos + j]) / 2.0;
+        VSignal[pos + j] = alt * (finalVSignal[posdel + j] - finalVSignal[pos + j]) / 2.0;
+    }
+}
 
-	delete[] colsignal.signal;
-	delete[] newSignal.signal;
-	delete[] finalSignal.signal;
-	delete[] finalUSignal.signal;
-	delete[] finalVSignal.signal;
-
-    return writeToSurface;
+//Write a decoded scanline to our frame
+void PALSystem::OutputScanline(int line, const float* finalSignal, OutputFrame frame, int field)
+{
+	int curjit = (int)jitterTrack[line];
+	if (curjit > scanlineJitterLimit) curjit = scanlineJitterLimit;
+	if (curjit < -scanlineJitterLimit) curjit = -scanlineJitterLimit; //Limit jitter distance to prevent buffer overflow
+    int pos = activeSignalStarts[line] + curjit;
+    DecodeScanline(finalSignal + pos, USignal + pos, VSignal + pos, activeWidth, frame, interlaced ? line * 2 + (field & 1) : line);
 }
 
 SignalPack PALSystem::AddText(SignalPack signal, const char* text, double x, int y, bool yRelativeToBottom)
@@ -317,7 +371,7 @@ SignalPack PALSystem::AddText(SignalPack signal, const char* text, double x, int
 	if (actualStartY < 0) actualStartY = 0;
 	double realActiveTime = bcParams->activeTime;
 	double realScanlineTime = 1.0 / (double)(fieldScanlines * bcParams->framerate);
-	double scanlineLength = FIXEDWIDTH * (realScanlineTime/realActiveTime);
+	double scanlineLength = activeWidth * (realScanlineTime/realActiveTime);
 	double scanlineIncPerSample = 1.0 / (scanlineLength * VHS_FONT_GLYPH_WIDTH);
 	float* sig = signal.signal;
 	while (curCh != 0)
@@ -21,17 +21,30 @@ const double YUVtoRGBConversionMatrix[9] = { 1.0,  0.0,      1.13983,
 class PALSystem : public ColourSystem
 {
 public:
-	PALSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent);
+	PALSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, CombFilterModes comb, bool iirFilters, QualityTiers quality, int width);
 
-    virtual SignalPack Encode(FrameData imgdat, int field) override;
-    virtual FrameData Decode(SignalPack signal, int field, double crosstalk) override;
+    using ColourSystem::Encode;
+    virtual SignalPack Encode(ComponentFrame imgdat, int field, float* output) override;
+    virtual void Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame) override;
     virtual SignalPack AddText(SignalPack signal, const char* text, double x, int y, bool yRelativeToBottom) override;
 private:
+    enum Streams
+    {
+        LumaPreStream,
+        UPreStream,
+        VPreStream,
+        CompositeStream,
+        LumaStream,
+        UStream,
+        VStream
+    };
+
     MultiOctaveNoiseGen* jitGen;
     MultiOctaveNoiseGen* phNoiseGen;
+    double* jitterTrack; //This field's noise, one per scanline
+    double* phaseTrack;
     bool interlaced;
     int fieldScanlines;
-    int activeWidth;
     int* boundaryPoints;
     int* activeSignalStarts;
     double sampleRate;
@@ -40,8 +53,17 @@ private:
     FIRFilter colfir;
     FIRFilter lumaprefir;
     FIRFilter chromaprefir;
+    bool useIIR;
+    IIRFilter mainiir;
+    IIRFilter coliir;
+    IIRFilter lumapreiir;
+    IIRFilter chromapreiir;
     float* USignal;
     float* VSignal;
     float* USignalPreAlt;
     float* VSignalPreAlt;
+
+    void DemodulateScanline(int line, const float* colsignal, double fieldPhaseAdv, double frameAlternation, double sampleTime);
+    void DelayLineScanline(int line, const float* finalUSignal, const float* finalVSignal);
+    void OutputScanline(int line, const float* finalSignal, OutputFrame frame, int field);
 };
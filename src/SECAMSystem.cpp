@@ -9,7 +9,7 @@
 #include "SECAMSystem.h"
 #include "VHSFont.h"
 
-SECAMSystem::SECAMSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent)
+SECAMSystem::SECAMSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, bool iirFilters, QualityTiers quality, int width)
 {
 	switch (sys)
 	{
@@ -51,10 +51,15 @@ SECAMSystem::SECAMSystem(BroadcastSystems sys, bool interlace, double resonance,
 
 	RGBtoYCCConversionMatrix = RGBtoYDbDrConversionMatrix;
 	YCCtoRGBConversionMatrix = YDbDrtoRGBConversionMatrix;
+	SetupEncodeGamma(2.8);
+	SetupDecodeGamma(2.8);
 
 	interlaced = interlace;
-	activeWidth = FIXEDWIDTH;
+	useIIR = iirFilters;
+    const QualityProfile* profile = GetQualityProfile(quality);
+    SetActiveWidth(width > 0 ? width : GetDefaultActiveWidth(bcParams, profile->sampleRateMargin));
 	fieldScanlines = interlace ? bcParams->videoScanlines / 2 : bcParams->videoScanlines;
+	signalLength = (int)(activeWidth * fieldScanlines * (bcParams->scanlineTime / bcParams->activeTime));
 	boundaryPoints = new int[fieldScanlines + 1]; //Boundaries of the scanline signals
 	activeSignalStarts = new int[fieldScanlines]; //Start points of the active parts
 	sampleRate = activeWidth / bcParams->activeTime; //Correction for the fact that the signal we've created only has active scanlines.
@@ -64,29 +69,31 @@ SECAMSystem::SECAMSystem(BroadcastSystems sys, bool interlace, double resonance,
 
 	std::cout << "Creating decode filters..." << std::endl;
 
-    mainfir = MakeFIRFilter(sampleRate, 256, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance);
-    dbfir = MakeFIRFilter(sampleRate, 256, (bcParams->chromaBandwidthUpperDb - bcParams->chromaBandwidthLowerDb) / 2.0, bcParams->chromaBandwidthLowerDb + bcParams->chromaBandwidthUpperDb, resonance);
-    drfir = MakeFIRFilter(sampleRate, 256, (bcParams->chromaBandwidthUpperDr - bcParams->chromaBandwidthLowerDr) / 2.0, bcParams->chromaBandwidthLowerDr + bcParams->chromaBandwidthUpperDr, resonance);
-    colfir = MakeFIRFilter(sampleRate, 256, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance);
+    if (useIIR) mainiir = MakeIIRFilter(sampleRate, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance);
+    else mainfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->mainBandwidth - bcParams->sideBandwidth) / 2.0, bcParams->mainBandwidth + bcParams->sideBandwidth, resonance, profile->filterTolerance);
+    if (useIIR) dbiir = MakeIIRFilter(sampleRate, (bcParams->chromaBandwidthUpperDb - bcParams->chromaBandwidthLowerDb) / 2.0, bcParams->chromaBandwidthLowerDb + bcParams->chromaBandwidthUpperDb, resonance);
+    else dbfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->chromaBandwidthUpperDb - bcParams->chromaBandwidthLowerDb) / 2.0, bcParams->chromaBandwidthLowerDb + bcParams->chromaBandwidthUpperDb, resonance, profile->filterTolerance);
+    if (useIIR) driir = MakeIIRFilter(sampleRate, (bcParams->chromaBandwidthUpperDr - bcParams->chromaBandwidthLowerDr) / 2.0, bcParams->chromaBandwidthLowerDr + bcParams->chromaBandwidthUpperDr, resonance);
+    else drfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->chromaBandwidthUpperDr - bcParams->chromaBandwidthLowerDr) / 2.0, bcParams->chromaBandwidthLowerDr + bcParams->chromaBandwidthUpperDr, resonance, profile->filterTolerance);
+    colfir = MakeFIRFilter(sampleRate, profile->filterTaps, (bcParams->chromaBandwidthUpper - bcParams->chromaBandwidthLower) / 2.0, bcParams->chromaBandwidthLower + bcParams->chromaBandwidthUpper, resonance, profile->filterTolerance); //Always FIR, the FM decoder is far too touchy about what comes out of this
 
     std::cout << "Creating prefilters..." << std::endl;
 
-    lumaprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE);
-    chromaprefir = MakeFIRFilter(sampleRate, 256, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE);
+    if (useIIR) lumapreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE);
+    else lumaprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->mainBandwidth * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
+    if (useIIR) chromapreiir = MakeIIRFilter(sampleRate, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE);
+    else chromaprefir = MakeFIRFilter(sampleRate, profile->filterTaps, 0.0, 2.0 * bcParams->chromaBandwidthLower * prefilterMult, PREFILTER_RESONANCE, profile->filterTolerance);
 
-    jitGen = new MultiOctaveNoiseGen(11, 0.0, scanlineJitter * activeWidth, noiseExponent);
-    phNoiseGen = new MultiOctaveNoiseGen(11, 0.0, phaseNoise, noiseExponent);
+    jitGen = new MultiOctaveNoiseGen(11, 0.0, scanlineJitter * activeWidth, noiseExponent, NoiseStreams::NoiseStreamJitter);
+    phNoiseGen = new MultiOctaveNoiseGen(11, 0.0, phaseNoise, noiseExponent, NoiseStreams::NoiseStreamPhase);
+    jitterTrack = new double[fieldScanlines];
 }
 
-SignalPack SECAMSystem::Encode(FrameData imgdat, int field)
+SignalPack SECAMSystem::Encode(ComponentFrame imgdat, int field, float* signalOut)
 {
     double realActiveTime = bcParams->activeTime;
     double realScanlineTime = bcParams->scanlineTime;
     int signalLen = (int)(imgdat.width * fieldScanlines * (realScanlineTime / realActiveTime)); //To get a good analogue feel, we must limit the vertical resolution; the horizontal resolution will be limited as we decode the distorted signal.
-    float* signalOut = new float[signalLen];
-    double R = 0.0;
-    double G = 0.0;
-    double B = 0.0;
     double Db = 0.0;
     double Dr = 0.0;
     double time = 0;
@@ -106,58 +113,61 @@ SignalPack SECAMSystem::Encode(FrameData imgdat, int field)
         activeSignalStarts[i] = (int)((((double)i * (double)signalLen) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * imgdat.width) - boundaryPoints[i];
     }
 
-    int* imgColours = imgdat.image;
     int currentScanline;
     double finSamp = 0.0;
     int w = imgdat.width;
-    int col;
     int interlaceField = field & 1;
     int subcarrierstartind = (int)((SUBCARRIER_START_TIME / realActiveTime) * ((double)imgdat.width));
-    SignalPack Ysig = { new float[signalLen], signalLen };
-    SignalPack Dbsig = { new float[signalLen], signalLen };
-    SignalPack Drsig = { new float[signalLen], signalLen };
-    //Make component signals
-    for (int i = 0; i < fieldScanlines; i++) //Only generate active scanlines
+    //Prefilter signals, unless this picture has just been through them
+    const int prefilterStreams[4] = { Streams::LumaPreStream, Streams::LumaNotchPreStream, Streams::DbPreStream, Streams::DrPreStream };
+    SignalPack prefiltered[3];
+    if (!ReusePrefiltered(imgdat.contentId, field, prefilterStreams, 4, prefiltered, 3))
     {
-        currentScanline = interlaced ? (i * 2 + interlaceField) % bcParams->videoScanlines : i;
-        for (int j = 0; j < activeSignalStarts[i]; j++) //Front porch, ignore sync signal because we don't see its results
+        SignalPack Ysig = { AllocSignal(signalLen), signalLen, nullptr };
+        SignalPack Dbsig = { AllocSignal(signalLen), signalLen, nullptr };
+        SignalPack Drsig = { AllocSignal(signalLen), signalLen, nullptr };
+        //Make component signals
+        for (int i = 0; i < fieldScanlines; i++) //Only generate active scanlines
         {
-            Ysig.signal[pos] = 0.0f;
-            Dbsig.signal[pos] = 0.0f;
-            Drsig.signal[pos] = 0.0f;
-            pos++;
-        }
-        for (int j = 0; j < imgdat.width; j++) //Active signal
-        {
-            col = imgColours[currentScanline * w + j];
-            R = ((col & 0x00FF0000) >> 16) / 255.0;
-            G = ((col & 0x0000FF00) >> 8) / 255.0;
-            B = (col & 0x000000FF) / 255.0;
-            R = SRGBGammaTransform(R); //SRGB correction
-            G = SRGBGammaTransform(G);
-            B = SRGBGammaTransform(B);
-            R = pow(R, 1.0 / 2.8); //Gamma correction
-            G = pow(G, 1.0 / 2.8);
-            B = pow(B, 1.0 / 2.8);
-            Ysig.signal[pos] = RGBtoYDbDrConversionMatrix[0] * R + RGBtoYDbDrConversionMatrix[1] * G + RGBtoYDbDrConversionMatrix[2] * B; //Encode Y, Db and Dr
-            Dbsig.signal[pos] = RGBtoYDbDrConversionMatrix[3] * R + RGBtoYDbDrConversionMatrix[4] * G + RGBtoYDbDrConversionMatrix[5] * B;
-            Drsig.signal[pos] = RGBtoYDbDrConversionMatrix[6] * R + RGBtoYDbDrConversionMatrix[7] * G + RGBtoYDbDrConversionMatrix[8] * B;
-            pos++;
-        }
-        while (pos < boundaryPoints[i + 1]) //Back porch, ignore sync signal because we don't see its results
-        {
-            Ysig.signal[pos] = 0.0f;
-            Dbsig.signal[pos] = 0.0f;
-            Drsig.signal[pos] = 0.0f;
-            pos++;
+            currentScanline = interlaced ? (i * 2 + interlaceField) % bcParams->videoScanlines : i;
+            for (int j = 0; j < activeSignalStarts[i]; j++) //Front porch, ignore sync signal because we don't see its results
+            {
+                Ysig.signal[pos] = 0.0f;
+                Dbsig.signal[pos] = 0.0f;
+                Drsig.signal[pos] = 0.0f;
+                pos++;
+            }
+            ReadComponentScanline(imgdat, currentScanline, Ysig.signal + pos, Dbsig.signal + pos, Drsig.signal + pos); //Active signal
+            pos += w;
+            while (pos < boundaryPoints[i + 1]) //Back porch, ignore sync signal because we don't see its results
+            {
+                Ysig.signal[pos] = 0.0f;
+                Dbsig.signal[pos] = 0.0f;
+                Drsig.signal[pos] = 0.0f;
+                pos++;
+            }
         }
-    }
 
-    //Prefilter signals
-    SignalPack filtYsig1 = ApplyFIRFilter(Ysig, lumaprefir);
-    SignalPack filtYsig2 = ApplyFIRFilterNotchShift(filtYsig1, chromaprefir, sampleTime, bcParams->carrierAngFreq);
-    SignalPack filtDbsig = ApplyFIRFilter(Dbsig, chromaprefir);
-    SignalPack filtDrsig = ApplyFIRFilter(Drsig, chromaprefir);
+        Ysig = ContinueStream(Ysig, Streams::LumaPreStream);
+        Dbsig = ContinueStream(Dbsig, Streams::DbPreStream);
+        Drsig = ContinueStream(Drsig, Streams::DrPreStream);
+        SignalPack filtYsig1 = ContinueStream(useIIR ? ApplyIIRFilter(Ysig, lumapreiir) : ApplyFIRFilter(Ysig, lumaprefir), Streams::LumaNotchPreStream);
+        prefiltered[0] = useIIR ? ApplyIIRFilterNotchShift(filtYsig1, chromapreiir, sampleTime, bcParams->carrierAngFreq) : ApplyFIRFilterNotchShift(filtYsig1, chromaprefir, sampleTime, bcParams->carrierAngFreq);
+        prefiltered[1] = useIIR ? ApplyIIRFilter(Dbsig, chromapreiir) : ApplyFIRFilter(Dbsig, chromaprefir);
+        prefiltered[2] = useIIR ? ApplyIIRFilter(Drsig, chromapreiir) : ApplyFIRFilter(Drsig, chromaprefir);
+        AdvanceStream(Ysig, Streams::LumaPreStream);
+        AdvanceStream(filtYsig1, Streams::LumaNotchPreStream);
+        AdvanceStream(Dbsig, Streams::DbPreStream);
+        AdvanceStream(Drsig, Streams::DrPreStream);
+        FreeSignal(filtYsig1.signal);
+        KeepPrefiltered(field, prefiltered, 3);
+        FreeSignal(Ysig.signal);
+        FreeSignal(Dbsig.signal);
+        FreeSignal(Drsig.signal);
+    }
+    SignalPack filtYsig2 = prefiltered[0];
+    SignalPack filtDbsig = prefiltered[1];
+    SignalPack filtDrsig = prefiltered[2];
     pos = 0;
     float* curChromaSig;
     double instantPhaseDb = 0.0;
@@ -205,28 +215,14 @@ SignalPack SECAMSystem::Encode(FrameData imgdat, int field)
         }
     }
 
-    delete[] Ysig.signal;
-    delete[] Dbsig.signal;
-    delete[] Drsig.signal;
-    delete[] filtYsig1.signal;
-    delete[] filtYsig2.signal;
-    delete[] filtDbsig.signal;
-    delete[] filtDrsig.signal;
-
-    return { signalOut, signalLen };
+    return { signalOut, signalLen, nullptr };
 }
 
-FrameData SECAMSystem::Decode(SignalPack signal, int field, double crosstalk)
+void SECAMSystem::Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame)
 {
     double realActiveTime = bcParams->activeTime;
     double realScanlineTime = bcParams->scanlineTime;
     double realFrameTime = (interlaced ? 2.0 : 1.0) / bcParams->framerate;
-    int R = 0;
-    int G = 0;
-    int B = 0;
-    double Y = 0.0;
-    double Db = 0.0;
-    double Dr = 0.0;
     int polarity = 0;
     int pos = 0;
     int DbPos = 0;
@@ -237,9 +233,11 @@ FrameData SECAMSystem::Decode(SignalPack signal, int field, double crosstalk)
     double freqPoint = 0.0;
     double sampleTime = realActiveTime / (double)activeWidth;
     
+    signal = ContinueStream(signal, Streams::CompositeStream);
     SignalPack DbSignal = ApplyFIRFilterCrosstalkShift(signal, colfir, crosstalk, sampleTime, bcParams->carrierAngFreqDb);
     SignalPack DrSignal = ApplyFIRFilterCrosstalkShift(signal, colfir, crosstalk, sampleTime, bcParams->carrierAngFreqDr);
-    SignalPack newSignal = ApplyFIRFilter(signal, mainfir);
+    SignalPack newSignal = ContinueStream(useIIR ? ApplyIIRFilter(signal, mainiir) : ApplyFIRFilter(signal, mainfir), Streams::LumaStream);
+    AdvanceStream(signal, Streams::CompositeStream);
 
     /**/
     //Extract FM colour signals (does anyone have a better way to do this rather than this hacky way?)
@@ -253,7 +251,7 @@ FrameData SECAMSystem::Decode(SignalPack signal, int field, double crosstalk)
     double DrDecodePhase = 0.0;
     double DbDeriv = 0.0;
     double DrDeriv = 0.0;
-    double DbLast = 0.0;
+    double DbLast = 0.0; //The first sample has nothing before it, so takes the last one as zero
     double DrLast = 0.0;
     double curDb = 0.0;
     double curDr = 0.0;
@@ -261,12 +259,10 @@ FrameData SECAMSystem::Decode(SignalPack signal, int field, double crosstalk)
     double DrFreqShift = 0.0;
     double DbLastFreqShift = 0.0;
     double DrLastFreqShift = 0.0;
-    SignalPack DbDecodedSignal = { new float[signal.len], signal.len };
-    SignalPack DrDecodedSignal = { new float[signal.len], signal.len };
+    SignalPack DbDecodedSignal = { AllocSignal(signal.len), signal.len, streamHistories[Streams::DbStream] };
+    SignalPack DrDecodedSignal = { AllocSignal(signal.len), signal.len, streamHistories[Streams::DrStream] };
     for (int i = 0; i < signal.len; i++) //Somehow this bunch of magic acts as a functional FM decoder
     {
-        DbLast = DbSignal.signal[i - 1];
-        DrLast = DrSignal.signal[i - 1];
         DbDeriv = (double)DbSignal.signal[i] - DbLast;
         DrDeriv = (double)DrSignal.signal[i] - DrLast;
         curDb = (DbDecodeAngFreq - scAngFreqDb) / scAngFreqShiftDb;
@@ -281,94 +277,57 @@ FrameData SECAMSystem::Decode(SignalPack signal, int field, double crosstalk)
         DrDecodePhase += sampleTime * DrDecodeAngFreq;
         DbLastFreqShift = DbFreqShift;
         DrLastFreqShift = DrFreqShift;
+        DbLast = DbSignal.signal[i];
+        DrLast = DrSignal.signal[i];
     }
     //*/
 
     SignalPack finalSignal = ApplyFIRFilterNotchCrosstalkShift(newSignal, colfir, crosstalk, sampleTime, bcParams->carrierAngFreq);
-    SignalPack finalDbSignal = ApplyFIRFilter(DbDecodedSignal, dbfir);
-    SignalPack finalDrSignal = ApplyFIRFilter(DrDecodedSignal, drfir);
+    SignalPack finalDbSignal = useIIR ? ApplyIIRFilter(DbDecodedSignal, dbiir) : ApplyFIRFilter(DbDecodedSignal, dbfir);
+    SignalPack finalDrSignal = useIIR ? ApplyIIRFilter(DrDecodedSignal, driir) : ApplyFIRFilter(DrDecodedSignal, drfir);
+    AdvanceStream(newSignal, Streams::LumaStream);
+    AdvanceStream(DbDecodedSignal, Streams::DbStream);
+    AdvanceStream(DrDecodedSignal, Streams::DrStream);
 
-    FrameData writeToSurface = { new int[activeWidth * fieldScanlines], activeWidth, fieldScanlines };
     for (int i = 0; i < fieldScanlines; i++) //Where the active signal starts
     {
         activeSignalStarts[i] = (int)((((double)i * (double)signal.len) / (double)fieldScanlines) + ((realScanlineTime - realActiveTime) / (2 * realActiveTime)) * activeWidth);
     }
+    SetScanlineJitterLimit(activeSignalStarts, fieldScanlines, signal.len);
 
-    int* surfaceColours = writeToSurface.image;
+    int interlaceField = field & 1;
     int currentScanline;
     int curjit = 0;
-    int finCol = 0;
-    double dR = 0.0;
-    double dG = 0.0;
-    double dB = 0.0;
+    jitGen->Seek((uint64_t)field * fieldScanlines); //Each field's jitter depends only on its number, so fields can be decoded in any order
+    jitGen->Generate(fieldScanlines, jitterTrack);
     //Write decoded signals to our frame
     for (int i = 0; i < fieldScanlines; i++)
     {
         componentAlternate = i % 2;
-        curjit = (int)jitGen->GenNoise();
-        if (curjit > 100) curjit = 100;
-        if (curjit < -100) curjit = -100; //Limit jitter distance to prevent buffer overflow
+        curjit = (int)jitterTrack[i];
+        if (curjit > scanlineJitterLimit) curjit = scanlineJitterLimit;
+        if (curjit < -scanlineJitterLimit) curjit = -scanlineJitterLimit; //Limit jitter distance to prevent buffer overflow
         pos = activeSignalStarts[i] + curjit;
         DbPos = activeSignalStarts[componentAlternate == 0 ? i : (i - 1)] + curjit;
         if (i <= 0)
         {
-            for (int j = 0; j < writeToSurface.width; j++) //Decode active signal region only
-            {
-                Y = finalSignal.signal[pos];
-                Db = finalDbSignal.signal[DbPos];
-                Dr = 0.0;
-                dR = pow(YDbDrtoRGBConversionMatrix[0] * Y + YDbDrtoRGBConversionMatrix[2] * Dr, 2.8);
-                dG = pow(YDbDrtoRGBConversionMatrix[3] * Y + YDbDrtoRGBConversionMatrix[4] * Db + YDbDrtoRGBConversionMatrix[5] * Dr, 2.8);
-                dB = pow(YDbDrtoRGBConversionMatrix[6] * Y + YDbDrtoRGBConversionMatrix[7] * Db, 2.8);
-                R = (int)(CD_CLAMP(SRGBInverseGammaTransform(dR), 0.0, 1.0) * 255.0);
-                G = (int)(CD_CLAMP(SRGBInverseGammaTransform(dG), 0.0, 1.0) * 255.0);
-                B = (int)(CD_CLAMP(SRGBInverseGammaTransform(dB), 0.0, 1.0) * 255.0);
-                finCol = 0xFF000000;
-                finCol |= R << 16;
-                finCol |= G << 8;
-                finCol |= B;
-                surfaceColours[i * writeToSurface.width + j] = finCol;
-                pos++;
-                DbPos++;
-            }
+            DecodeScanline(finalSignal.signal + pos, finalDbSignal.signal + DbPos, nullptr, activeWidth, frame, interlaced ? i * 2 + interlaceField : i); //No Dr line yet
         }
         else
         {
             DrPos = activeSignalStarts[componentAlternate == 0 ? (i - 1) : i] + curjit;
-
-            for (int j = 0; j < writeToSurface.width; j++) //Decode active signal region only
-            {
-                Y = finalSignal.signal[pos];
-                Db = finalDbSignal.signal[DbPos];
-                Dr = finalDrSignal.signal[DrPos];
-                dR = pow(YDbDrtoRGBConversionMatrix[0] * Y + YDbDrtoRGBConversionMatrix[2] * Dr, 2.8);
-                dG = pow(YDbDrtoRGBConversionMatrix[3] * Y + YDbDrtoRGBConversionMatrix[4] * Db + YDbDrtoRGBConversionMatrix[5] * Dr, 2.8);
-                dB = pow(YDbDrtoRGBConversionMatrix[6] * Y + YDbDrtoRGBConversionMatrix[7] * Db, 2.8);
-                R = (int)(CD_CLAMP(SRGBInverseGammaTransform(dR), 0.0, 1.0) * 255.0);
-                G = (int)(CD_CLAMP(SRGBInverseGammaTransform(dG), 0.0, 1.0) * 255.0);
-                B = (int)(CD_CLAMP(SRGBInverseGammaTransform(dB), 0.0, 1.0) * 255.0);
-                finCol = 0xFF000000;
-                finCol |= R << 16;
-                finCol |= G << 8;
-                finCol |= B;
-                surfaceColours[i * writeToSurface.width + j] = finCol;
-                pos++;
-                DbPos++;
-                DrPos++;
-            }
+            DecodeScanline(finalSignal.signal + pos, finalDbSignal.signal + DbPos, finalDrSignal.signal + DrPos, activeWidth, frame, interlaced ? i * 2 + interlaceField : i);
         }
     }
 
-    delete[] DbSignal.signal;
-    delete[] DrSignal.signal;
-    delete[] DbDecodedSignal.signal;
-    delete[] DrDecodedSignal.signal;
-    delete[] newSignal.signal;
-    delete[] finalSignal.signal;
-    delete[] finalDbSignal.signal;
-    delete[] finalDrSignal.signal;
-
-    return writeToSurface;
+    FreeSignal(DbSignal.signal);
+    FreeSignal(DrSignal.signal);
+    FreeSignal(DbDecodedSignal.signal);
+    FreeSignal(DrDecodedSignal.signal);
+    FreeSignal(newSignal.signal);
+    FreeSignal(finalSignal.signal);
+    FreeSignal(finalDbSignal.signal);
+    FreeSignal(finalDrSignal.signal);
 }
 
 //I know this is wrong! (TODO)
@@ -384,7 +343,7 @@ SignalPack SECAMSystem::AddText(SignalPack signal, const char* text, double x, i
 	if (actualStartY < 0) actualStartY = 0;
 	double realActiveTime = bcParams->activeTime;
 	double realScanlineTime = 1.0 / (double)(fieldScanlines * bcParams->framerate);
-	double scanlineLength = FIXEDWIDTH * (realScanlineTime/realActiveTime);
+	double scanlineLength = activeWidth * (realScanlineTime/realActiveTime);
 	double scanlineIncPerSample = 1.0 / (scanlineLength * VHS_FONT_GLYPH_WIDTH);
 	float* sig = signal.signal;
 	while (curCh != 0)
@@ -23,17 +23,30 @@ const double YDbDrtoRGBConversionMatrix[9] = { 1.0,  0.0,               -0.52591
 class SECAMSystem : public ColourSystem
 {
 public:
-    SECAMSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent);
+    SECAMSystem(BroadcastSystems sys, bool interlace, double resonance, double prefilterMult, double phaseNoise, double scanlineJitter, double noiseExponent, bool iirFilters, QualityTiers quality, int width);
 
-    virtual SignalPack Encode(FrameData imgdat, int field) override;
-    virtual FrameData Decode(SignalPack signal, int field, double crosstalk) override;
+    using ColourSystem::Encode;
+    virtual SignalPack Encode(ComponentFrame imgdat, int field, float* output) override;
+    virtual void Decode(SignalPack signal, int field, double crosstalk, OutputFrame frame) override;
     virtual SignalPack AddText(SignalPack signal, const char* text, double x, int y, bool yRelativeToBottom) override;
 private:
+    enum Streams
+    {
+        LumaPreStream,
+        LumaNotchPreStream,
+        DbPreStream,
+        DrPreStream,
+        CompositeStream,
+        LumaStream,
+        DbStream,
+        DrStream
+    };
+
     MultiOctaveNoiseGen* jitGen;
     MultiOctaveNoiseGen* phNoiseGen;
+    double* jitterTrack; //This field's jitter, one per scanline
     bool interlaced;
     int fieldScanlines;
-    int activeWidth;
     int* boundaryPoints;
     int* activeSignalStarts;
     double sampleRate;
@@ -44,4 +57,10 @@ private:
     FIRFilter colfir;
     FIRFilter lumaprefir;
     FIRFilter chromaprefir;
+    bool useIIR;
+    IIRFilter mainiir;
+    IIRFilter dbiir;
+    IIRFilter driir;
+    IIRFilter lumapreiir;
+    IIRFilter chromapreiir;
 };
@@ -0,0 +1,119 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* Recycled buffers for the signals that get made and thrown away every field
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include "SignalPool.h"
+
+#define SIGNAL_POOL_MAGIC 0x5349474Eu
+#define SIGNAL_POOL_GUARD_BYTE 0xFD
+#define SIGNAL_POOL_MAX_SLACK 4096 //A free buffer this many samples (or double the request) bigger than needed is left for something it fits better
+
+//Each block is laid out as this header, padded out to the alignment, then the front guard band, the samples, and the back guard band
+typedef struct SignalBlock
+{
+	struct SignalBlock* next;
+	int capacity;
+	unsigned int magic;
+} SignalBlock;
+
+#define SIGNAL_POOL_HEADER_BYTES (((sizeof(SignalBlock) + SIGNAL_POOL_ALIGNMENT - 1) / SIGNAL_POOL_ALIGNMENT) * SIGNAL_POOL_ALIGNMENT)
+#define SIGNAL_POOL_DATA_OFFSET (SIGNAL_POOL_HEADER_BYTES + SIGNAL_POOL_GUARD_BYTES)
+
+static SignalBlock* freeBlocks = nullptr;
+
+static unsigned char* GetBlockData(SignalBlock* block)
+{
+	return (unsigned char*)block + SIGNAL_POOL_DATA_OFFSET;
+}
+
+static SignalBlock* GetSignalBlock(float* signal)
+{
+	return (SignalBlock*)((unsigned char*)signal - SIGNAL_POOL_DATA_OFFSET);
+}
+
+static bool GuardsIntact(SignalBlock* block)
+{
+	const unsigned char* front = GetBlockData(block) - SIGNAL_POOL_GUARD_BYTES;
+	const unsigned char* back = GetBlockData(block) + block->capacity * sizeof(float);
+	for (int i = 0; i < SIGNAL_POOL_GUARD_BYTES; i++)
+	{
+		if (front[i] != SIGNAL_POOL_GUARD_BYTE || back[i] != SIGNAL_POOL_GUARD_BYTE) return false;
+	}
+	return true;
+}
+
+static SignalBlock* NewSignalBlock(int len)
+{
+	const int alignedLen = ((len + SIGNAL_POOL_ALIGNMENT / sizeof(float) - 1) / (SIGNAL_POOL_ALIGNMENT / sizeof(float))) * (SIGNAL_POOL_ALIGNMENT / sizeof(float));
+	size_t size = SIGNAL_POOL_DATA_OFFSET + alignedLen * sizeof(float) + SIGNAL_POOL_GUARD_BYTES;
+	SignalBlock* block = (SignalBlock*)::operator new(size, std::align_val_t(SIGNAL_POOL_ALIGNMENT));
+	block->next = nullptr;
+	block->capacity = alignedLen;
+	block->magic = SIGNAL_POOL_MAGIC;
+	memset(GetBlockData(block) - SIGNAL_POOL_GUARD_BYTES, SIGNAL_POOL_GUARD_BYTE, SIGNAL_POOL_GUARD_BYTES);
+	memset(GetBlockData(block) + alignedLen * sizeof(float), SIGNAL_POOL_GUARD_BYTE, SIGNAL_POOL_GUARD_BYTES);
+	return block;
+}
+
+//Best fit out of the free buffers, otherwise a new one
+float* AllocSignal(int len)
+{
+	if (len < 1) len = 1;
+	SignalBlock* block = nullptr;
+	#pragma omp critical(signalpool)
+	{
+		SignalBlock** bestLink = nullptr;
+		for (SignalBlock** link = &freeBlocks; *link != nullptr; link = &(*link)->next)
+		{
+			int capacity = (*link)->capacity;
+			if (capacity < len || (capacity - len > SIGNAL_POOL_MAX_SLACK && capacity > 2 * len)) continue;
+			if (bestLink == nullptr || capacity < (*bestLink)->capacity) bestLink = link;
+		}
+		if (bestLink != nullptr)
+		{
+			block = *bestLink;
+			*bestLink = block->next;
+		}
+	}
+	if (block == nullptr) block = NewSignalBlock(len);
+	block->next = nullptr;
+	return (float*)GetBlockData(block);
+}
+
+//Anything that wrote past either end of the buffer will have trampled a guard band, and the signals after it can't be trusted, so stop there
+void FreeSignal(float* signal)
+{
+	if (signal == nullptr) return;
+	SignalBlock* block = GetSignalBlock(signal);
+	if (block->magic != SIGNAL_POOL_MAGIC || !GuardsIntact(block))
+	{
+		std::cerr << "Signal buffer overrun detected, stopping." << std::endl;
+		abort();
+	}
+	#pragma omp critical(signalpool)
+	{
+		block->next = freeBlocks;
+		freeBlocks = block;
+	}
+}
+
+//Hands all the free buffers back to the heap
+void ReleaseSignalPool()
+{
+	#pragma omp critical(signalpool)
+	{
+		while (freeBlocks != nullptr)
+		{
+			SignalBlock* next = freeBlocks->next;
+			::operator delete(freeBlocks, std::align_val_t(SIGNAL_POOL_ALIGNMENT));
+			freeBlocks = next;
+		}
+	}
+}
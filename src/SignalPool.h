@@ -0,0 +1,16 @@
+/*
+* VideoAnalogiser - Command Line Utility for Analogising Digital Videos
+* Maxim Hoxha 2023-2026
+* Recycled buffers for the signals that get made and thrown away every field
+* This software uses code of FFmpeg (http://ffmpeg.org) licensed under the LGPLv2.1 (http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html)
+*/
+
+#pragma once
+
+#define SIGNAL_POOL_ALIGNMENT 64 //A cache line, and enough for any SIMD width
+#define SIGNAL_POOL_GUARD_BYTES 64 //Guard band either side of each buffer, checked when it comes back
+
+//Buffers handed out here must go back through FreeSignal(), never delete[]. Once every size a field needs has been seen, no more heap allocations are made.
+float* AllocSignal(int len);
+void FreeSignal(float* signal);
+void ReleaseSignalPool();
@@ -7,53 +7,80 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <cmath>
 #include <cstring>
+#include <array>
+#include <utility>
 #include "Utils.h"
+#include "FilterCache.h"
+#include "SignalPool.h"
 
 #define FILTER_MAKE_INTEGRAL_POINTS 16384
 #define FILTER_MAKE_INTEGRAL_POINTS_DBL 16384.0
-#define FILTER_MAGNITUDE_TOLERANCE 0.03
 #define FILTER_MAX_STEPS_TOLERANCE 7
+#define IIR_LANES 8
+#define IIR_SEGMENT_LEN 2048
+#define IIR_WARMUP 128
+#define COMB_MOTION_THRESHOLD 0.05f
+#define COMB_MOTION_SCALE 10.0f
+#define FIR_TAP_BUCKET_SIZE 16 //Filters are padded with zero taps up to a multiple of this, so the kernel for that tap count can be picked
+#define FIR_TAP_BUCKETS 32 //Longer filters than this many buckets use the general loop
 
 static inline double StandardFilter(double f, double attenuation)
 {
     return 1 / sqrt(1 + pow(fabs(f), 2 * attenuation)); //Butterworth filter, but modified to allow a real (rather than strictly natural) number of 'poles'
 }
 
-FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width, double attenuation)
+//The Simpson's rule sum for one tap. The response samples already carry the Simpson weights, and the cosines come from a table since the sample points are evenly spaced.
+static double IntegrateFilterTap(const double* response, const double* cosTable, int tap, double tapPhase)
+{
+    const int points = 2 * FILTER_MAKE_INTEGRAL_POINTS;
+    const int mask = points - 1;
+    const int quarter = points / 4;
+    double cosSum = 0.0;
+    double sinSum = 0.0;
+    #pragma omp parallel for reduction(+:cosSum, sinSum)
+    for (int k = 0; k <= points; k++)
+    {
+        int ind = (int)(((long long)tap * k) & mask);
+        cosSum += response[k] * cosTable[ind];
+        sinSum += response[k] * cosTable[(ind - quarter) & mask];
+    }
+    return cosSum * cos(tapPhase) - sinSum * sin(tapPhase);
+}
+
+static FIRFilter DesignFIRFilter(double sampleRate, int size, double center, double width, double attenuation, double tolerance)
 {
     int backport = 5;
     double* outfir = new double[size + backport];
     double integral = 0.0;
-    double integpoint = 0.0;
-    double freqpointbef = 0.0;
-    double freqpointmid = 0.0;
-    double freqpointaf = 0.0;
-    double sampleTime = 1 / sampleRate;
     double trueW = 1 / (width * 0.5);
     int truesize = 0;
     int truebackport = 0;
     int stepsUnderTolerance = 0;
 
+    //The response doesn't depend on the tap, so sample it once for all of them, along with the Simpson's rule weights (1, 4, 2, 4, ..., 4, 1)
+    //The following integral bounds may seem strange, but they were found to create better filters that don't require rescaling
+    const int points = 2 * FILTER_MAKE_INTEGRAL_POINTS;
+    double* response = new double[points + 1];
+    double* cosTable = new double[points];
+    #pragma omp parallel for
+    for (int k = 0; k <= points; k++)
+    {
+        double freqpoint = (sampleRate * ((((double)k) / (2.0 * FILTER_MAKE_INTEGRAL_POINTS_DBL)) - 0.5)) + center;
+        double weight = (k == 0 || k == points) ? 1.0 : ((k & 1) ? 4.0 : 2.0);
+        response[k] = weight * StandardFilter((freqpoint - center) * trueW, attenuation) / (6.0 * FILTER_MAKE_INTEGRAL_POINTS_DBL);
+        if (k < points) cosTable[k] = cos(2.0 * M_PI * ((double)k) / (double)points);
+    }
+    const double tapPhaseStep = 2.0 * M_PI * ((center / sampleRate) - 0.5); //What's left of the cosine's argument once the table handles the evenly spaced part
+
     for (int i = 1; i <= backport; i++) //Do filter components from AFTER the zero point first
     {
-        integral = 0.0;
-        for (int j = 0; j < FILTER_MAKE_INTEGRAL_POINTS; j++) //Integrate with Simpson's rule
-        {
-            //The following integral bounds may seem strange, but they were found to create better filters that don't require rescaling
-            freqpointbef = (sampleRate * ((((double)j) / FILTER_MAKE_INTEGRAL_POINTS_DBL) - 0.5)) + center;
-            freqpointaf = (sampleRate * ((((double)(j + 1)) / FILTER_MAKE_INTEGRAL_POINTS_DBL) - 0.5)) + center;
-            freqpointmid = (freqpointaf + freqpointbef) * 0.5;
-            integpoint = cos(-2.0 * M_PI * freqpointbef * sampleTime * i) * StandardFilter((freqpointbef - center) * trueW, attenuation);
-            integpoint += (4.0 * cos(-2.0 * M_PI * freqpointmid * sampleTime * i)) * StandardFilter((freqpointmid - center) * trueW, attenuation);
-            integpoint += cos(-2.0 * M_PI * freqpointaf * sampleTime * i) * StandardFilter((freqpointaf - center) * trueW, attenuation);
-            integpoint *= (freqpointaf - freqpointbef) / 6.0;
-            integral += integpoint / sampleRate;
-        }
+        integral = IntegrateFilterTap(response, cosTable, i, tapPhaseStep * i); //The cosine is even, so these come out the same as the ones before the zero point
         outfir[backport - i] = integral;
         truesize++;
         truebackport++;
-        if (fabs(integral) < FILTER_MAGNITUDE_TOLERANCE)
+        if (fabs(integral) < tolerance)
         {
             stepsUnderTolerance++;
         }
@@ -69,23 +96,11 @@ FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width
     stepsUnderTolerance = 0;
     for (int i = 0; i < size; i++) //Then do it for the filter components ON and BEFORE the zero point
     {
-        integral = 0.0;
-        for (int j = 0; j < FILTER_MAKE_INTEGRAL_POINTS; j++) //Integrate with Simpson's rule
-        {
-            //The following integral bounds may seem strange, but they were found to create better filters that don't require rescaling
-            freqpointbef = (sampleRate * ((((double)j) / FILTER_MAKE_INTEGRAL_POINTS_DBL) - 0.5)) + center;
-            freqpointaf = (sampleRate * ((((double)(j + 1)) / FILTER_MAKE_INTEGRAL_POINTS_DBL) - 0.5)) + center;
-            freqpointmid = (freqpointaf + freqpointbef) * 0.5;
-            integpoint = cos(2.0 * M_PI * freqpointbef * sampleTime * i) * StandardFilter((freqpointbef - center) * trueW, attenuation);
-            integpoint += (4.0 * cos(2.0 * M_PI * freqpointmid * sampleTime * i)) * StandardFilter((freqpointmid - center) * trueW, attenuation);
-            integpoint += cos(2.0 * M_PI * freqpointaf * sampleTime * i) * StandardFilter((freqpointaf - center) * trueW, attenuation);
-            integpoint *= (freqpointaf - freqpointbef) / 6.0;
-            integral += integpoint / sampleRate;
-        }
+        integral = IntegrateFilterTap(response, cosTable, i, tapPhaseStep * i);
         if (abs(i) > truebackport) integral *= 2.0;
         outfir[i + backport] = integral;
         truesize++;
-        if (fabs(integral) < FILTER_MAGNITUDE_TOLERANCE)
+        if (fabs(integral) < tolerance)
         {
             stepsUnderTolerance++;
         }
@@ -98,6 +113,8 @@ FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width
             break;
         }
     }
+    delete[] response;
+    delete[] cosTable;
 
     //Normalise the filter to avoid brightness changes
     /**/
@@ -123,174 +140,816 @@ FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width
     delete[] outfir;
 
     //Returning this pointer as the zero point to simplify addressing the filter components (i.e. filter[-2] is valid and points to the filter component 2 samples behind the current point)
-    return { realOutFir + truesize - truebackport - 1, truesize - truebackport,  truebackport };
+    return { realOutFir + truesize - truebackport - 1, truesize - truebackport,  truebackport, 0 };
 }
 
-SignalPack ApplyFIRFilter(SignalPack signal, FIRFilter fir)
+//The taps rounded up to the next bucket, 0 if the filter is too long for any of them
+static int GetBucketTapCount(FIRFilter fir)
+{
+    int taps = fir.len + fir.backport;
+    int bucketTaps = ((taps + FIR_TAP_BUCKET_SIZE - 1) / FIR_TAP_BUCKET_SIZE) * FIR_TAP_BUCKET_SIZE;
+    return bucketTaps <= FIR_TAP_BUCKETS * FIR_TAP_BUCKET_SIZE ? bucketTaps : 0;
+}
+
+//Copies the taps into their own array, with zero taps after them up to the bucket, so the convolution never has to pad them itself
+static FIRFilter PadFIRFilter(FIRFilter fir)
+{
+    int taps = fir.len + fir.backport;
+    int bucketTaps = GetBucketTapCount(fir);
+    int paddedTaps = bucketTaps > taps ? bucketTaps : taps;
+    float* padded = new float[paddedTaps];
+    memcpy(padded, fir.filter - fir.len + 1, taps * sizeof(float));
+    memset(padded + taps, 0, (paddedTaps - taps) * sizeof(float));
+    delete[] (fir.filter - fir.len + 1);
+    return { padded + fir.len - 1, fir.len, fir.backport, bucketTaps };
+}
+
+//Designing filters isn't free, and the same few get made on every run, so they're kept on disk
+FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width, double attenuation, double tolerance)
 {
-    float* output = new float[signal.len];
-    float outsig = 0.0f;
+    FilterCacheKey key;
+    memset(&key, 0, sizeof(key));
+    key.sampleRate = sampleRate;
+    key.center = center;
+    key.width = width;
+    key.attenuation = attenuation;
+    key.size = size;
+    key.designParams[0] = FILTER_MAKE_INTEGRAL_POINTS;
+    key.designParams[1] = (int)(tolerance * 1000000.0);
+    key.designParams[2] = FILTER_MAX_STEPS_TOLERANCE;
+
+    FIRFilter fir;
+    if (LoadCachedFIRFilter(&key, &fir)) return PadFIRFilter(fir);
+    fir = DesignFIRFilter(sampleRate, size, center, width, attenuation, tolerance);
+    SaveCachedFIRFilter(&key, fir);
+    return PadFIRFilter(fir);
+}
+
+//Copies the last count samples from before the signal into dest, padding with silence if there's no history (or not enough of it)
+static void CopySignalHistory(float* dest, int count, SignalPack signal)
+{
+    int available = signal.history == nullptr ? 0 : (count < SIGNAL_HISTORY_LEN ? count : SIGNAL_HISTORY_LEN);
+    memset(dest, 0, (count - available) * sizeof(float));
+    if (available > 0) memcpy(dest + count - available, signal.history + SIGNAL_HISTORY_LEN - available, available * sizeof(float));
+}
+
+float* MakeSignalHistory()
+{
+    float* history = new float[SIGNAL_HISTORY_LEN];
+    memset(history, 0, SIGNAL_HISTORY_LEN * sizeof(float));
+    return history;
+}
+
+//Keeps the end of the signal around for the next field. Mind that this overwrites signal.history if it points to the same place.
+void PushSignalHistory(float* history, SignalPack signal)
+{
+    if (signal.len >= SIGNAL_HISTORY_LEN)
+    {
+        memcpy(history, signal.signal + signal.len - SIGNAL_HISTORY_LEN, SIGNAL_HISTORY_LEN * sizeof(float));
+        return;
+    }
+    memmove(history, history + signal.len, (SIGNAL_HISTORY_LEN - signal.len) * sizeof(float));
+    memcpy(history + SIGNAL_HISTORY_LEN - signal.len, signal.signal, signal.len * sizeof(float));
+}
+
+//With the tap count fixed at compile time, the inner loop is unrolled and vectorised across taps. sig[i] lines up with the first tap for output[i].
+template <int TAPS>
+static void ConvolveKernel(const float* sig, const float* taps, float* output, int start, int end)
+{
+    #pragma omp parallel for
+    for (int i = start; i < end; i++)
+    {
+        const float* insig = sig + i;
+        float outsigin = 0.0f;
+        #pragma omp simd reduction(+:outsigin)
+        for (int j = 0; j < TAPS; j++)
+        {
+            outsigin += insig[j] * taps[j];
+        }
+        output[i] = outsigin;
+    }
+}
 
-    for (int i = 0; i < fir.len; i++) //Ease in
+static void ConvolveGeneral(const float* sig, const float* taps, int tapCount, float* output, int start, int end)
+{
+    #pragma omp parallel for
+    for (int i = start; i < end; i++)
     {
-        outsig = 0.0f;
-        const float* insig = signal.signal + i;
-        for (int j = -i; j <= fir.backport; j++)
+        const float* insig = sig + i;
+        float outsigin = 0.0f;
+        for (int j = 0; j < tapCount; j++)
         {
-            outsig += insig[j] * fir.filter[j];
+            outsigin += insig[j] * taps[j];
         }
-        output[i] = outsig;
+        output[i] = outsigin;
     }
+}
+
+typedef void (*ConvolveFunction)(const float* sig, const float* taps, float* output, int start, int end);
+
+template <size_t... Buckets>
+static constexpr std::array<ConvolveFunction, sizeof...(Buckets)> MakeConvolveKernelTable(std::index_sequence<Buckets...>)
+{
+    return { { ConvolveKernel<((int)Buckets + 1) * FIR_TAP_BUCKET_SIZE>... } };
+}
+
+static const std::array<ConvolveFunction, FIR_TAP_BUCKETS> convolveKernels = MakeConvolveKernelTable(std::make_index_sequence<FIR_TAP_BUCKETS>());
+
+//output[i] for i in [start, end) from sig[i] onwards. The caller makes sure the signal has room for the padding taps (which are zero) past the filter's own.
+static void Convolve(const float* sig, FIRFilter fir, float* output, int start, int end)
+{
+    if (start >= end) return;
+    const float* firstTap = fir.filter - fir.len + 1;
+    if (fir.bucketTaps == 0) ConvolveGeneral(sig, firstTap, fir.len + fir.backport, output, start, end);
+    else convolveKernels[fir.bucketTaps / FIR_TAP_BUCKET_SIZE - 1](sig, firstTap, output, start, end);
+}
+
+SignalPack ApplyFIRFilter(SignalPack signal, FIRFilter fir)
+{
+    return ApplyFIRFilter(signal, fir, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilter(SignalPack signal, FIRFilter fir, float* output)
+{
+    //Put the history in front and silence behind, then every sample can go through the same loop without special cases at the ends
+    const int lead = fir.len - 1;
+    const int trail = fir.bucketTaps == 0 ? fir.backport : fir.bucketTaps - fir.len;
+    float* padded = AllocSignal(lead + signal.len + trail);
+    CopySignalHistory(padded, lead, signal);
+    memcpy(padded + lead, signal.signal, signal.len * sizeof(float));
+    memset(padded + lead + signal.len, 0, trail * sizeof(float));
+
+    //Main loop. This is embarrasingly parallel
+    Convolve(padded, fir, output, 0, signal.len);
+
+    FreeSignal(padded);
+    return { output, signal.len, nullptr };
+}
+
+//The taps of the notch, crosstalk and shifted variants: filtMult times the filter (shifted up to centerangfreq unless that's zero), with passMult added at the centre if passThrough is set so some of the original signal gets through as well
+FIRFilter MakeMixedFIRFilter(FIRFilter fir, double filtMult, double passMult, bool passThrough, double sampleTime, double centerangfreq)
+{
+    const int taps = fir.len + fir.backport;
+    const int paddedTaps = fir.bucketTaps > taps ? fir.bucketTaps : taps;
+    float* mixfir = AllocSignal(paddedTaps);
+    float* actualMixfir = mixfir + fir.len - 1;
+    memset(mixfir + taps, 0, (paddedTaps - taps) * sizeof(float)); //Same padding as the filter it's made from
+    double time = 0.0;
+
+    for (int i = -fir.len + 1; i <= fir.backport; i++)
+    {
+        time = i * sampleTime;
+        if (centerangfreq == 0.0) actualMixfir[i] = fir.filter[i] * filtMult;
+        else actualMixfir[i] = fir.filter[i] * cos(centerangfreq * time) * filtMult * 2.0; //This takes advantage of a crucial property of Fourier transforms
+    }
+    if (passThrough) actualMixfir[0] = filtMult * fir.filter[0] + passMult;
+
+    return { actualMixfir, fir.len, fir.backport, fir.bucketTaps };
+}
+
+void FreeMixedFIRFilter(FIRFilter fir)
+{
+    FreeSignal(fir.filter - fir.len + 1);
+}
 
-    const int parStart = fir.len;
-    const int parEnd = signal.len - fir.backport;
+//Near the ends of the signal, where the history or the silence after it come in
+static void ApplyFIRFilterEdge(SignalPack signal, FIRFilter fir, float* output, int start, int end)
+{
     const int filtStart = -fir.len + 1;
     const int filtEnd = fir.backport;
     const float* const sig = signal.signal;
     const float* const filt = fir.filter;
+    const int len = signal.len;
 
-    //Main loop. This is embarrasingly parallel
     #pragma omp parallel for
-    for (int i = parStart; i < parEnd; i++)
+    for (int i = start; i < end; i++)
     {
         float outsigin = 0.0f;
-        const float* insig = sig + i;
         for (int j = filtStart; j <= filtEnd; j++)
         {
-            outsigin += insig[j] * filt[j];
+            int pos = i + j;
+            float insig = 0.0f;
+            if (pos < 0) insig = (signal.history == nullptr || pos < -SIGNAL_HISTORY_LEN) ? 0.0f : signal.history[SIGNAL_HISTORY_LEN + pos];
+            else if (pos < len) insig = sig[pos];
+            outsigin += insig * filt[j];
         }
         output[i] = outsigin;
     }
+}
+
+//Filters just output[start, end), reading the signal (and its history) directly. Unlike ApplyFIRFilter(), this can't work in place, but it leaves the rest of the output alone, so a chain of filters can be run a band at a time.
+void ApplyFIRFilterRange(SignalPack signal, FIRFilter fir, float* output, int start, int end)
+{
+    //Samples from innerStart to innerEnd don't need the history or the silence after the signal, even with the padding taps
+    const int innerStart = CD_CLAMP(fir.len - 1, start, end);
+    const int innerEnd = CD_CLAMP(signal.len - (fir.bucketTaps == 0 ? fir.backport : fir.bucketTaps - fir.len), innerStart, end);
+
+    ApplyFIRFilterEdge(signal, fir, output, start, innerStart);
+    Convolve(signal.signal - fir.len + 1, fir, output, innerStart, innerEnd);
+    ApplyFIRFilterEdge(signal, fir, output, innerEnd, end);
+}
+
+SignalPack ApplyFIRFilterNotch(SignalPack signal, FIRFilter fir)
+{
+    return ApplyFIRFilterNotch(signal, fir, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterNotch(SignalPack signal, FIRFilter fir, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, -1.0, 1.0, true, 0.0, 0.0);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+SignalPack ApplyFIRFilterCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk)
+{
+    return ApplyFIRFilterCrosstalk(signal, fir, crosstalk, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, 1.0 - crosstalk, crosstalk, true, 0.0, 0.0);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+SignalPack ApplyFIRFilterShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq)
+{
+    return ApplyFIRFilterShift(signal, fir, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, 1.0, 0.0, false, sampleTime, centerangfreq);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+SignalPack ApplyFIRFilterNotchCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk)
+{
+    return ApplyFIRFilterNotchCrosstalk(signal, fir, crosstalk, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterNotchCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, crosstalk - 1.0, 1.0, true, 0.0, 0.0);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+SignalPack ApplyFIRFilterCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq)
+{
+    return ApplyFIRFilterCrosstalkShift(signal, fir, crosstalk, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, 1.0 - crosstalk, crosstalk, true, sampleTime, centerangfreq);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+SignalPack ApplyFIRFilterNotchShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq)
+{
+    return ApplyFIRFilterNotchShift(signal, fir, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterNotchShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, -1.0, 1.0, true, sampleTime, centerangfreq);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+SignalPack ApplyFIRFilterNotchCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq)
+{
+    return ApplyFIRFilterNotchCrosstalkShift(signal, fir, crosstalk, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyFIRFilterNotchCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq, float* output)
+{
+    FIRFilter mixed = MakeMixedFIRFilter(fir, crosstalk - 1.0, 1.0, true, sampleTime, centerangfreq);
+    SignalPack outsig = ApplyFIRFilter(signal, mixed, output);
+    FreeMixedFIRFilter(mixed);
+    return outsig;
+}
+
+//Butterworth lowpass as a cascade of second order sections, with the usual bilinear transform
+static void MakeButterworthSections(float (*coeffs)[5], int order, double cutoff, double sampleRate)
+{
+    if (cutoff > sampleRate * 0.45) cutoff = sampleRate * 0.45;
+    double w0 = 2.0 * M_PI * cutoff / sampleRate;
+    double cosw0 = cos(w0);
+    int section = 0;
+    for (int i = 1; i <= order / 2; i++)
+    {
+        double q = 1.0 / (2.0 * sin(M_PI * (2 * i - 1) / (2.0 * order)));
+        double alpha = sin(w0) / (2.0 * q);
+        double a0 = 1.0 + alpha;
+        coeffs[section][0] = ((1.0 - cosw0) * 0.5) / a0;
+        coeffs[section][1] = (1.0 - cosw0) / a0;
+        coeffs[section][2] = ((1.0 - cosw0) * 0.5) / a0;
+        coeffs[section][3] = (-2.0 * cosw0) / a0;
+        coeffs[section][4] = (1.0 - alpha) / a0;
+        section++;
+    }
+    if (order & 1) //Odd orders need one first order section
+    {
+        double k = tan(w0 * 0.5);
+        coeffs[section][0] = k / (1.0 + k);
+        coeffs[section][1] = k / (1.0 + k);
+        coeffs[section][2] = 0.0;
+        coeffs[section][3] = (k - 1.0) / (k + 1.0);
+        coeffs[section][4] = 0.0;
+    }
+}
 
-    for (int i = signal.len - fir.backport; i < signal.len; i++) //Ease out
+//Designs Butterworth lowpasses that, run forwards then backwards, roughly match the response of the filters from MakeFIRFilter()
+IIRFilter MakeIIRFilter(double sampleRate, double center, double width, double attenuation)
+{
+    IIRFilter iir;
+    int order = (int)(attenuation * 0.5 + 0.5); //Running it twice doubles the slope
+    order = CD_CLAMP(order, 1, IIR_MAX_SECTIONS * 2);
+    iir.sections = (order + 1) / 2;
+    double cutoffCorr = pow(M_SQRT2 - 1.0, -1.0 / (2.0 * order)); //Put the -3dB point of the squared response where StandardFilter() has it
+    //The FIR filters have real components, so an off-center response ends up averaged with its mirror image, which is about the same as averaging two lowpasses
+    double innerCutoff = width * 0.5 - fabs(center);
+    double outerCutoff = width * 0.5 + fabs(center);
+    iir.dual = center != 0.0 && innerCutoff > 0.0;
+    MakeButterworthSections(iir.coeffs[0], order, outerCutoff * cutoffCorr, sampleRate);
+    if (iir.dual) MakeButterworthSections(iir.coeffs[1], order, innerCutoff * cutoffCorr, sampleRate);
+    return iir;
+}
+
+//Runs the filter over one segment of the signal per lane, so the recursion can be vectorised across lanes. Data is interleaved as [sample][lane].
+static void RunIIRLanes(float* data, int len, const float (*coeffs)[5], int sections)
+{
+    for (int s = 0; s < sections; s++)
     {
-        outsig = 0.0f;
-        const float* insig = signal.signal + i;
-        for (int j = -fir.len; j < signal.len - i; j++)
+        const float b0 = coeffs[s][0];
+        const float b1 = coeffs[s][1];
+        const float b2 = coeffs[s][2];
+        const float a1 = coeffs[s][3];
+        const float a2 = coeffs[s][4];
+        float z1[IIR_LANES] = {};
+        float z2[IIR_LANES] = {};
+        for (int i = 0; i < len; i++) //Forwards
+        {
+            float* x = data + i * IIR_LANES;
+            for (int l = 0; l < IIR_LANES; l++)
+            {
+                float y = b0 * x[l] + z1[l];
+                z1[l] = b1 * x[l] - a1 * y + z2[l];
+                z2[l] = b2 * x[l] - a2 * y;
+                x[l] = y;
+            }
+        }
+        for (int l = 0; l < IIR_LANES; l++)
+        {
+            z1[l] = 0.0f;
+            z2[l] = 0.0f;
+        }
+        for (int i = len - 1; i >= 0; i--) //Then backwards to cancel out the phase shift
         {
-            outsig += insig[j] * fir.filter[j];
+            float* x = data + i * IIR_LANES;
+            for (int l = 0; l < IIR_LANES; l++)
+            {
+                float y = b0 * x[l] + z1[l];
+                z1[l] = b1 * x[l] - a1 * y + z2[l];
+                z2[l] = b2 * x[l] - a2 * y;
+                x[l] = y;
+            }
         }
-        output[i] = outsig;
     }
+}
+
+//Splits the signal into overlapping segments, the overlap lets each segment's filter state settle so the seams don't show
+static void RunIIRFilter(const float* in, const float* history, float* out, int len, const IIRFilter& iir)
+{
+    const int numSegments = (len + IIR_SEGMENT_LEN - 1) / IIR_SEGMENT_LEN;
+    const int numGroups = (numSegments + IIR_LANES - 1) / IIR_LANES;
+    const int bufLen = IIR_SEGMENT_LEN + 2 * IIR_WARMUP;
+    const int groupBufLen = bufLen * IIR_LANES * (iir.dual ? 2 : 1);
+    float* groupBufs = AllocSignal(numGroups * groupBufLen); //One go for every group, rather than each thread asking for its own
 
-    return { output, signal.len };
+    #pragma omp parallel for
+    for (int g = 0; g < numGroups; g++)
+    {
+        float* buf = groupBufs + g * groupBufLen;
+        float* dualBuf = iir.dual ? buf + bufLen * IIR_LANES : nullptr;
+        const int groupStart = g * IIR_LANES * IIR_SEGMENT_LEN - IIR_WARMUP;
+        if (groupStart >= 0 && groupStart + (IIR_LANES - 1) * IIR_SEGMENT_LEN + bufLen <= len) //Most groups are nowhere near the ends, so skip the bounds checks
+        {
+            for (int i = 0; i < bufLen; i++)
+            {
+                for (int l = 0; l < IIR_LANES; l++)
+                {
+                    buf[i * IIR_LANES + l] = in[groupStart + l * IIR_SEGMENT_LEN + i];
+                }
+            }
+        }
+        else
+        {
+            for (int i = 0; i < bufLen; i++)
+            {
+                for (int l = 0; l < IIR_LANES; l++)
+                {
+                    int pos = groupStart + l * IIR_SEGMENT_LEN + i;
+                    if (pos < 0) buf[i * IIR_LANES + l] = history == nullptr ? 0.0f : history[SIGNAL_HISTORY_LEN + pos]; //The warm-up is shorter than the history
+                    else buf[i * IIR_LANES + l] = pos < len ? in[pos] : 0.0f;
+                }
+            }
+        }
+        if (iir.dual)
+        {
+            memcpy(dualBuf, buf, bufLen * IIR_LANES * sizeof(float));
+            RunIIRLanes(dualBuf, bufLen, iir.coeffs[1], iir.sections);
+            RunIIRLanes(buf, bufLen, iir.coeffs[0], iir.sections);
+            for (int i = 0; i < bufLen * IIR_LANES; i++)
+            {
+                buf[i] = 0.5f * (buf[i] + dualBuf[i]);
+            }
+        }
+        else
+        {
+            RunIIRLanes(buf, bufLen, iir.coeffs[0], iir.sections);
+        }
+        for (int l = 0; l < IIR_LANES; l++)
+        {
+            int start = (g * IIR_LANES + l) * IIR_SEGMENT_LEN;
+            int end = CD_CLAMP(len - start, 0, IIR_SEGMENT_LEN);
+            for (int i = 0; i < end; i++)
+            {
+                out[start + i] = buf[(i + IIR_WARMUP) * IIR_LANES + l];
+            }
+        }
+    }
+    FreeSignal(groupBufs);
 }
 
-SignalPack ApplyFIRFilterNotch(SignalPack signal, FIRFilter fir)
+//Every IIR variant is some mix of the filtered signal and the original signal, shifted variants move the lowpass up to the given frequency by heterodyning
+static SignalPack ApplyIIRFilterMix(SignalPack signal, const IIRFilter& iir, float filtMult, float passMult, double sampleTime, double centerangfreq, float* output)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
+    const float* const sig = signal.signal;
+    if (centerangfreq == 0.0)
+    {
+        RunIIRFilter(sig, signal.history, output, signal.len, iir);
+        for (int i = 0; i < signal.len; i++)
+        {
+            output[i] = filtMult * output[i] + passMult * sig[i];
+        }
+        return { output, signal.len, nullptr };
+    }
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+    float* carrierCos = AllocSignal(signal.len);
+    float* carrierSin = AllocSignal(signal.len);
+    float* inphase = AllocSignal(signal.len);
+    float* quadrature = AllocSignal(signal.len);
+    const double stepCos = cos(centerangfreq * sampleTime);
+    const double stepSin = sin(centerangfreq * sampleTime);
+    double curCos = 1.0;
+    double curSin = 0.0;
+    for (int i = 0; i < signal.len; i++) //Rotate the carrier rather than calling cos() and sin() for every sample, resynchronising now and then to stop errors building up
     {
-        actualShiftfir[i] = -fir.filter[i];
+        if ((i & 1023) == 0)
+        {
+            double time = i * sampleTime;
+            curCos = cos(centerangfreq * time);
+            curSin = sin(centerangfreq * time);
+        }
+        carrierCos[i] = curCos;
+        carrierSin[i] = curSin;
+        inphase[i] = sig[i] * carrierCos[i];
+        quadrature[i] = sig[i] * carrierSin[i];
+        double nextCos = curCos * stepCos - curSin * stepSin;
+        curSin = curSin * stepCos + curCos * stepSin;
+        curCos = nextCos;
     }
-    actualShiftfir[0] = 1.0 - fir.filter[0];
+    float* inphaseHistory = nullptr;
+    float* quadratureHistory = nullptr;
+    if (signal.history != nullptr) //The history has to be shifted down just the same
+    {
+        inphaseHistory = AllocSignal(SIGNAL_HISTORY_LEN);
+        quadratureHistory = AllocSignal(SIGNAL_HISTORY_LEN);
+        for (int i = 0; i < SIGNAL_HISTORY_LEN; i++)
+        {
+            double time = (i - SIGNAL_HISTORY_LEN) * sampleTime;
+            inphaseHistory[i] = signal.history[i] * cos(centerangfreq * time);
+            quadratureHistory[i] = signal.history[i] * sin(centerangfreq * time);
+        }
+    }
+    float* filtQuadrature = AllocSignal(signal.len);
+    RunIIRFilter(inphase, inphaseHistory, output, signal.len, iir); //Can't filter in place, since neighbouring segments overlap
+    RunIIRFilter(quadrature, quadratureHistory, filtQuadrature, signal.len, iir);
+    for (int i = 0; i < signal.len; i++)
+    {
+        float shifted = 2.0f * (carrierCos[i] * output[i] + carrierSin[i] * filtQuadrature[i]);
+        output[i] = filtMult * shifted + passMult * sig[i];
+    }
+    FreeSignal(carrierCos);
+    FreeSignal(carrierSin);
+    FreeSignal(inphase);
+    FreeSignal(quadrature);
+    FreeSignal(filtQuadrature);
+    FreeSignal(inphaseHistory);
+    FreeSignal(quadratureHistory);
+    return { output, signal.len, nullptr };
+}
 
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
+SignalPack ApplyIIRFilter(SignalPack signal, IIRFilter iir)
+{
+    return ApplyIIRFilter(signal, iir, AllocSignal(signal.len));
 }
 
-SignalPack ApplyFIRFilterCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk)
+SignalPack ApplyIIRFilter(SignalPack signal, IIRFilter iir, float* output)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
+    return ApplyIIRFilterMix(signal, iir, 1.0f, 0.0f, 0.0, 0.0, output);
+}
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+SignalPack ApplyIIRFilterNotch(SignalPack signal, IIRFilter iir)
+{
+    return ApplyIIRFilterNotch(signal, iir, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterNotch(SignalPack signal, IIRFilter iir, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, -1.0f, 1.0f, 0.0, 0.0, output);
+}
+
+SignalPack ApplyIIRFilterCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk)
+{
+    return ApplyIIRFilterCrosstalk(signal, iir, crosstalk, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, 1.0 - crosstalk, crosstalk, 0.0, 0.0, output);
+}
+
+SignalPack ApplyIIRFilterShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq)
+{
+    return ApplyIIRFilterShift(signal, iir, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, 1.0f, 0.0f, sampleTime, centerangfreq, output);
+}
+
+SignalPack ApplyIIRFilterNotchCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk)
+{
+    return ApplyIIRFilterNotchCrosstalk(signal, iir, crosstalk, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterNotchCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, crosstalk - 1.0, 1.0f, 0.0, 0.0, output);
+}
+
+SignalPack ApplyIIRFilterCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq)
+{
+    return ApplyIIRFilterCrosstalkShift(signal, iir, crosstalk, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, 1.0 - crosstalk, crosstalk, sampleTime, centerangfreq, output);
+}
+
+SignalPack ApplyIIRFilterNotchShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq)
+{
+    return ApplyIIRFilterNotchShift(signal, iir, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterNotchShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, -1.0f, 1.0f, sampleTime, centerangfreq, output);
+}
+
+SignalPack ApplyIIRFilterNotchCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq)
+{
+    return ApplyIIRFilterNotchCrosstalkShift(signal, iir, crosstalk, sampleTime, centerangfreq, AllocSignal(signal.len));
+}
+
+SignalPack ApplyIIRFilterNotchCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq, float* output)
+{
+    return ApplyIIRFilterMix(signal, iir, crosstalk - 1.0, 1.0f, sampleTime, centerangfreq, output);
+}
+
+DelayLine MakeDelayLine(double delay)
+{
+    DelayLine dl;
+    dl.delay = (int)floor(delay);
+    double frac = delay - dl.delay;
+    double sum = 0.0;
+    double taps[8];
+    for (int i = 0; i < 8; i++) //Blackman-windowed sinc, good enough to keep the subcarrier intact
     {
-        actualShiftfir[i] = fir.filter[i] * (1.0 - crosstalk);
+        double x = (i - 3) - frac;
+        double sinc = fabs(x) < 1e-9 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double window = 0.42 + 0.5 * cos(M_PI * x / 4.0) + 0.08 * cos(M_PI * x / 2.0);
+        taps[i] = sinc * window;
+        sum += taps[i];
     }
-    actualShiftfir[0] = (1.0 - crosstalk) * fir.filter[0] + crosstalk;
-
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
+    for (int i = 0; i < 8; i++)
+    {
+        dl.filter[i] = taps[i] / sum;
+    }
+    return dl;
 }
 
-SignalPack ApplyFIRFilterShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq)
+//Returns the chroma part of the signal, the luma part is then just the signal minus this.
+SignalPack ApplyCombFilter(SignalPack signal, DelayLine dl, bool threeLine)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
-    double time = 0.0;
+    float* output = AllocSignal(signal.len);
+    const float* const sig = signal.signal;
+    const int prevStart = dl.delay + 4;
+    const int nextEnd = signal.len - dl.delay - 4;
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+    //Also embarrasingly parallel
+    #pragma omp parallel for
+    for (int i = 0; i < signal.len; i++)
     {
-        time = i * sampleTime;
-        actualShiftfir[i] = fir.filter[i] * cos(centerangfreq * time) * 2.0; //This takes advantage of a crucial property of Fourier transforms
+        const bool hasPrev = i >= prevStart;
+        const bool hasNext = i < nextEnd;
+        float prev = 0.0f;
+        float next = 0.0f;
+        if (hasPrev)
+        {
+            const float* insig = sig + i - dl.delay + 3;
+            for (int j = 0; j < 8; j++)
+            {
+                prev += insig[-j] * dl.filter[j];
+            }
+        }
+        if (hasNext)
+        {
+            const float* insig = sig + i + dl.delay - 3;
+            for (int j = 0; j < 8; j++)
+            {
+                next += insig[j] * dl.filter[j];
+            }
+        }
+        //The delayed scanlines carry the subcarrier in antiphase, so differences keep chroma and cancel luma
+        if (threeLine && hasPrev && hasNext) output[i] = (2.0f * sig[i] - prev - next) * 0.25f;
+        else if (hasPrev) output[i] = (sig[i] - prev) * 0.5f;
+        else if (hasNext) output[i] = (sig[i] - next) * 0.5f;
+        else output[i] = 0.0f;
     }
 
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
+    return { output, signal.len, nullptr };
 }
 
-SignalPack ApplyFIRFilterNotchCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk)
+static inline float GetSample(const float* signal, int i)
+{
+    return signal[i];
+}
+
+static inline float GetSample(const CompactSample* signal, int i)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
+    return signal[i] * (1.0f / COMPACT_SIGNAL_SCALE);
+}
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+//Blends between a field comb and the given line comb output depending on how much the picture moved since the last field with the same subcarrier phase
+template <typename T>
+static SignalPack ApplyFieldCombFilterKernel(SignalPack signal, SignalPack lineChroma, const T* lastField, const T* samePhaseField)
+{
+    float* output = AllocSignal(signal.len);
+    const float* const sig = signal.signal;
+    const float* const lineChr = lineChroma.signal;
+
+    #pragma omp parallel for
+    for (int i = 0; i < signal.len; i++)
     {
-        actualShiftfir[i] = fir.filter[i] * (crosstalk - 1.0);
+        float fieldChr = (sig[i] - GetSample(lastField, i)) * 0.5f;
+        float motion = samePhaseField == nullptr ? 1.0f : (fabsf(sig[i] - GetSample(samePhaseField, i)) - COMB_MOTION_THRESHOLD) * COMB_MOTION_SCALE;
+        motion = CD_CLAMP(motion, 0.0f, 1.0f);
+        output[i] = fieldChr + motion * (lineChr[i] - fieldChr);
     }
-    actualShiftfir[0] = 1.0 + (crosstalk - 1.0) * fir.filter[0];
 
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
+    return { output, signal.len, nullptr };
 }
 
-SignalPack ApplyFIRFilterCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq)
+SignalPack ApplyFieldCombFilter(SignalPack signal, SignalPack lineChroma, const float* lastField, const float* samePhaseField)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
-    double time = 0.0;
+    return ApplyFieldCombFilterKernel(signal, lineChroma, lastField, samePhaseField);
+}
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+SignalPack ApplyFieldCombFilter(SignalPack signal, SignalPack lineChroma, const CompactSample* lastField, const CompactSample* samePhaseField)
+{
+    return ApplyFieldCombFilterKernel(signal, lineChroma, lastField, samePhaseField);
+}
+
+//Rounds to the nearest step, anything out of range is clipped
+void CompactSignal(const float* signal, CompactSample* output, int len)
+{
+    #pragma omp parallel for simd
+    for (int i = 0; i < len; i++)
     {
-        time = i * sampleTime;
-        actualShiftfir[i] = fir.filter[i] * cos(centerangfreq * time) * (1.0 - crosstalk) * 2.0;
+        float scaled = signal[i] * COMPACT_SIGNAL_SCALE;
+        scaled = CD_CLAMP(scaled, -32767.0f, 32767.0f);
+        output[i] = (CompactSample)(scaled + (scaled < 0.0f ? -0.5f : 0.5f));
     }
-    actualShiftfir[0] = (1.0 - crosstalk) * fir.filter[0] + crosstalk;
-
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
 }
 
-SignalPack ApplyFIRFilterNotchShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq)
+//The carrier phase at each sample is the phase at the start of the run plus a whole number of steps, so the phase can't drift within a run. Runs are scanline length, keeping the phase small enough that float still resolves it to around 1e-4 radians.
+template <typename T>
+static void ModulateQAMKernel(const float* base, const float* sinComp, const float* cosComp, float* out, int len, double startPhase, double phaseStep, double cosMult)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
-    double time = 0.0;
+    const T start = (T)startPhase;
+    const T step = (T)phaseStep;
+    const T cMult = (T)cosMult;
+    #pragma omp simd
+    for (int i = 0; i < len; i++)
+    {
+        T phase = start + (T)i * step;
+        out[i] = (float)((T)base[i] + (T)sinComp[i] * std::sin(phase) + cMult * (T)cosComp[i] * std::cos(phase));
+    }
+}
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+template <typename T>
+static void DemodulateQAMKernel(const float* sinIn, const float* cosIn, float* sinOut, float* cosOut, int len, double startPhase, double phaseStep, double sinMult, double cosMult)
+{
+    const T start = (T)startPhase;
+    const T step = (T)phaseStep;
+    const T sMult = (T)sinMult;
+    const T cMult = (T)cosMult;
+    #pragma omp simd
+    for (int i = 0; i < len; i++)
     {
-        time = i * sampleTime;
-        actualShiftfir[i] = -fir.filter[i] * cos(centerangfreq * time) * 2.0;
+        T phase = start + (T)i * step;
+        T sinVal = (T)sinIn[i];
+        T cosVal = (T)cosIn[i];
+        sinOut[i] = (float)(sMult * sinVal * std::sin(phase));
+        cosOut[i] = (float)(cMult * cosVal * std::cos(phase));
     }
-    actualShiftfir[0] = 1.0 - fir.filter[0];
+}
 
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
+//out = base + sinComp * sin(phase) + cosMult * cosComp * cos(phase)
+void ModulateQAM(KernelPrecision precision, const float* base, const float* sinComp, const float* cosComp, float* out, int len, double startPhase, double phaseStep, double cosMult)
+{
+    if (precision == KernelPrecision::PrecisionSingle) ModulateQAMKernel<float>(base, sinComp, cosComp, out, len, startPhase, phaseStep, cosMult);
+    else ModulateQAMKernel<double>(base, sinComp, cosComp, out, len, startPhase, phaseStep, cosMult);
 }
 
-SignalPack ApplyFIRFilterNotchCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq)
+//sinOut = sinMult * sinIn * sin(phase), cosOut = cosMult * cosIn * cos(phase). Either output can be the same array as its input.
+void DemodulateQAM(KernelPrecision precision, const float* sinIn, const float* cosIn, float* sinOut, float* cosOut, int len, double startPhase, double phaseStep, double sinMult, double cosMult)
 {
-    float* shiftfir = new float[fir.len + fir.backport];
-    float* actualShiftfir = shiftfir + fir.len - 1;
-    double time = 0.0;
+    if (precision == KernelPrecision::PrecisionSingle) DemodulateQAMKernel<float>(sinIn, cosIn, sinOut, cosOut, len, startPhase, phaseStep, sinMult, cosMult);
+    else DemodulateQAMKernel<double>(sinIn, cosIn, sinOut, cosOut, len, startPhase, phaseStep, sinMult, cosMult);
+}
 
-    for (int i = -fir.len + 1; i <= fir.backport; i++)
+//Runs a run of len samples of saturated bars through both precisions of the modulator and demodulator, and gives the worst difference between them. Full scale is about 1.
+double MeasureKernelPrecisionError(int len, double phaseStep)
+{
+    float* base = new float[len];
+    float* sinComp = new float[len];
+    float* cosComp = new float[len];
+    float* outs[2][3];
+    for (int p = 0; p < 2; p++)
     {
-        time = i * sampleTime;
-        actualShiftfir[i] = fir.filter[i] * cos(centerangfreq * time) * (crosstalk - 1.0) * 2.0;
+        for (int k = 0; k < 3; k++)
+        {
+            outs[p][k] = new float[len];
+        }
     }
-    actualShiftfir[0] = 1.0 + (crosstalk - 1.0) * fir.filter[0];
-
-    SignalPack outsig = ApplyFIRFilter(signal, { actualShiftfir, fir.len, fir.backport });
-    delete[] shiftfir;
-    return outsig;
+    for (int i = 0; i < len; i++)
+    {
+        int bar = (i * 8) / len;
+        base[i] = (bar & 1) ? 0.7f : 0.3f;
+        sinComp[i] = (bar & 2) ? 0.45f : -0.45f;
+        cosComp[i] = (bar & 4) ? 0.6f : -0.6f;
+    }
+    const KernelPrecision precisions[2] = { KernelPrecision::PrecisionDouble, KernelPrecision::PrecisionSingle };
+    const double startPhase = 2.0 * M_PI - 1e-3; //As big as the start phase ever gets
+    for (int p = 0; p < 2; p++)
+    {
+        ModulateQAM(precisions[p], base, sinComp, cosComp, outs[p][0], len, startPhase, phaseStep, -1.0);
+        DemodulateQAM(precisions[p], outs[p][0], outs[p][0], outs[p][1], outs[p][2], len, startPhase, phaseStep, 2.0, 2.0);
+    }
+    double worst = 0.0;
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            worst = fmax(worst, fabs((double)outs[0][k][i] - (double)outs[1][k][i]));
+        }
+    }
+    delete[] base;
+    delete[] sinComp;
+    delete[] cosComp;
+    for (int p = 0; p < 2; p++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            delete[] outs[p][k];
+        }
+    }
+    return worst;
 }
@@ -12,22 +12,89 @@ typedef struct
 	float* filter; //Note that this array is intended to be addressed with NEGATIVE numbers as well, because it makes handling them easier
 	int len; //Length of components BEFORE and ON the zero point
 	int backport; //Length of components AFTER the zero point. This is physically justifiable because one could just use delay lines on signals.
+	int bucketTaps; //All the taps padded with zeros to the convolution kernel's tap count, or 0 if the filter isn't padded and takes the general loop
 } FIRFilter;
 
+#define IIR_MAX_SECTIONS 4
+
+typedef struct
+{
+	float coeffs[2][IIR_MAX_SECTIONS][5]; //b0, b1, b2, a1, a2 of each second order section, the first order ones just have b2 = a2 = 0
+	int sections;
+	bool dual; //Off-center filters average two cascades, since that's what the symmetric response of the FIR filters ends up looking like
+} IIRFilter; //Always run forwards then backwards, so it has no phase shift just like the FIR filters
+
+#define SIGNAL_HISTORY_LEN 256 //Enough for the longest filter MakeFIRFilter() can make
+
 typedef struct //Literally just made because I copied a bunch of code from my own AnalogueConvertEffect, which was written in C#. This structure made it easier to handle the signal arrays
 {
 	float* signal;
 	int len;
+	const float* history; //The SIGNAL_HISTORY_LEN samples that came right before this signal, so filters can carry on from the last field. Silence is assumed if this is null.
 } SignalPack;
 
+typedef struct
+{
+	float filter[8]; //Interpolates between samples, tap i sits at (delay + i - 3) samples away
+	int delay; //Whole part of the delay
+} DelayLine;
+
+enum KernelPrecision
+{
+	PrecisionSingle, //Float all the way through, twice the SIMD lanes. Carrier phases are still worked out in double at the start of each run.
+	PrecisionDouble
+};
+
+typedef short CompactSample; //A signal sample kept in 16 bits, for signals that are stored rather than worked on
+#define COMPACT_SIGNAL_SCALE 8192.0f //Steps per unit of signal, so anything within +/-4 fits, and the steps are around 80 dB below peak white
+
 #define CD_CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 
-FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width, double attenuation);
+FIRFilter MakeFIRFilter(double sampleRate, int size, double center, double width, double attenuation, double tolerance);
+//Every filter also has a version that writes into the given output, which needs room for signal.len samples. The FIR filters can work in place (output = signal.signal), the IIR ones can't.
 SignalPack ApplyFIRFilter(SignalPack signal, FIRFilter fir);
+SignalPack ApplyFIRFilter(SignalPack signal, FIRFilter fir, float* output);
 SignalPack ApplyFIRFilterNotch(SignalPack signal, FIRFilter fir);
+SignalPack ApplyFIRFilterNotch(SignalPack signal, FIRFilter fir, float* output);
 SignalPack ApplyFIRFilterCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk);
+SignalPack ApplyFIRFilterCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk, float* output);
 SignalPack ApplyFIRFilterShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq);
+SignalPack ApplyFIRFilterShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq, float* output);
 SignalPack ApplyFIRFilterNotchCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk);
+SignalPack ApplyFIRFilterNotchCrosstalk(SignalPack signal, FIRFilter fir, double crosstalk, float* output);
 SignalPack ApplyFIRFilterCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq);
+SignalPack ApplyFIRFilterCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq, float* output);
 SignalPack ApplyFIRFilterNotchShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq);
+SignalPack ApplyFIRFilterNotchShift(SignalPack signal, FIRFilter fir, double sampleTime, double centerangfreq, float* output);
 SignalPack ApplyFIRFilterNotchCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq);
+SignalPack ApplyFIRFilterNotchCrosstalkShift(SignalPack signal, FIRFilter fir, double crosstalk, double sampleTime, double centerangfreq, float* output);
+FIRFilter MakeMixedFIRFilter(FIRFilter fir, double filtMult, double passMult, bool passThrough, double sampleTime, double centerangfreq);
+void FreeMixedFIRFilter(FIRFilter fir);
+void ApplyFIRFilterRange(SignalPack signal, FIRFilter fir, float* output, int start, int end);
+IIRFilter MakeIIRFilter(double sampleRate, double center, double width, double attenuation);
+SignalPack ApplyIIRFilter(SignalPack signal, IIRFilter iir);
+SignalPack ApplyIIRFilter(SignalPack signal, IIRFilter iir, float* output);
+SignalPack ApplyIIRFilterNotch(SignalPack signal, IIRFilter iir);
+SignalPack ApplyIIRFilterNotch(SignalPack signal, IIRFilter iir, float* output);
+SignalPack ApplyIIRFilterCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk);
+SignalPack ApplyIIRFilterCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk, float* output);
+SignalPack ApplyIIRFilterShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq);
+SignalPack ApplyIIRFilterShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq, float* output);
+SignalPack ApplyIIRFilterNotchCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk);
+SignalPack ApplyIIRFilterNotchCrosstalk(SignalPack signal, IIRFilter iir, double crosstalk, float* output);
+SignalPack ApplyIIRFilterCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq);
+SignalPack ApplyIIRFilterCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq, float* output);
+SignalPack ApplyIIRFilterNotchShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq);
+SignalPack ApplyIIRFilterNotchShift(SignalPack signal, IIRFilter iir, double sampleTime, double centerangfreq, float* output);
+SignalPack ApplyIIRFilterNotchCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq);
+SignalPack ApplyIIRFilterNotchCrosstalkShift(SignalPack signal, IIRFilter iir, double crosstalk, double sampleTime, double centerangfreq, float* output);
+float* MakeSignalHistory();
+void PushSignalHistory(float* history, SignalPack signal);
+DelayLine MakeDelayLine(double delay);
+SignalPack ApplyCombFilter(SignalPack signal, DelayLine dl, bool threeLine);
+SignalPack ApplyFieldCombFilter(SignalPack signal, SignalPack lineChroma, const float* lastField, const float* samePhaseField);
+SignalPack ApplyFieldCombFilter(SignalPack signal, SignalPack lineChroma, const CompactSample* lastField, const CompactSample* samePhaseField);
+void CompactSignal(const float* signal, CompactSample* output, int len);
+void ModulateQAM(KernelPrecision precision, const float* base, const float* sinComp, const float* cosComp, float* out, int len, double startPhase, double phaseStep, double cosMult);
+void DemodulateQAM(KernelPrecision precision, const float* sinIn, const float* cosIn, float* sinOut, float* cosOut, int len, double startPhase, double phaseStep, double sinMult, double cosMult);
+double MeasureKernelPrecisionError(int len, double phaseStep);
@@ -26,6 +26,13 @@ void ShowHelp()
 	std::cout << "-psnoise <amount>: Colour decoder phase noise (per scanline), recommended values 0.0 - 3.0. Defaults to 0.0." << std::endl;
 	std::cout << "-crosstalk <amount>: Decoder luma-chroma crosstalk, recommended values 0.0 - 1.0. Defaults to 0.0." << std::endl;
 	std::cout << "-noiseexp <amount>: Jitter and scanline phase noise spectrum exponent (goes as f^-amount), recommended values 0.0 - 1.0. Defaults to 0.5." << std::endl;
+	std::cout << "-comb <mode>: Separate luma and chroma with a comb filter instead of bandpass and notch filters (PAL and NTSC only). Valid values: off, 2line, 3line, 3d. Defaults to off." << std::endl;
+	std::cout << "-iir: Use recursive (Butterworth) filters instead of the usual FIR filters. Much quicker to set up, and the cost per sample stays the same however narrow the filters get." << std::endl;
+	std::cout << "-samples <count>: Number of samples across the visible part of each scanline. Lower values are faster but blurrier. Defaults to just enough for the broadcast standard's bandwidth." << std::endl;
+	std::cout << "-quality <tier>: Trade accuracy for speed. Valid values: draft, normal, high. Draft also only simulates every other field. Defaults to normal." << std::endl;
+	std::cout << "-compact: Keep the signals the 3D comb filter stores as 16-bit samples, halving the memory it goes through each field." << std::endl;
+	std::cout << "-max-memory <MiB>: Give up frame blending and some reuse of earlier work, if needed, to stay within this much memory. The peak memory use is shown at the end." << std::endl;
+	std::cout << "-memstats: When done, report heap allocations by stage and peak memory use, and check that nothing was allocated per field once warmed up (exits with 3 if something was)." << std::endl;
 	std::cout << "-text <text>: Put VHS text in the top left." << std::endl;
 	std::cout << "-timetext: Put VHS text in the bottom left indicating the time since the video start (HH:MM:SS:FF)." << std::endl;
 }
@@ -90,6 +97,13 @@ int main(int argc, char** argv)
 	double jitter = 0.0;
 	double dResonance = 5.0;
 	double pWidthMult = 0.7;
+	CombFilterModes comb = CombFilterModes::CombOff;
+	bool iirFilters = false;
+	bool compactSignals = false;
+	bool memoryStats = false;
+	double maxMemory = 0.0;
+	int activeWidth = 0;
+	QualityTiers quality = QualityTiers::QualityNormal;
 	const char* tlText = nullptr;
 	for (int i = 3; i < argc; i++)
 	{
@@ -126,6 +140,36 @@ int main(int argc, char** argv)
 			else if (!strcmp(argv[i], "vhs525")) bSys = BroadcastSystems::VHS525;
 			else if (!strcmp(argv[i], "vhs625")) bSys = BroadcastSystems::VHS625;
 		}
+		else if (!strcmp(argv[i], "-iir"))
+		{
+			iirFilters = true;
+		}
+		else if (!strcmp(argv[i], "-compact"))
+		{
+			compactSignals = true;
+		}
+		else if (!strcmp(argv[i], "-max-memory"))
+		{
+			i++;
+			maxMemory = strtod(argv[i], NULL);
+		}
+		else if (!strcmp(argv[i], "-memstats"))
+		{
+			memoryStats = true;
+		}
+		else if (!strcmp(argv[i], "-samples"))
+		{
+			i++;
+			activeWidth = atoi(argv[i]);
+		}
+		else if (!strcmp(argv[i], "-quality"))
+		{
+			i++;
+			if (i >= argc) break;
+			else if (!strcmp(argv[i], "draft")) quality = QualityTiers::QualityDraft;
+			else if (!strcmp(argv[i], "normal")) quality = QualityTiers::QualityNormal;
+			else if (!strcmp(argv[i], "high")) quality = QualityTiers::QualityHigh;
+		}
 		else if (!strcmp(argv[i], "-timetext"))
 		{
 			timeText = true;
@@ -165,6 +209,15 @@ int main(int argc, char** argv)
 			i++;
 			noiseExp = strtod(argv[i], NULL);
 		}
+		else if (!strcmp(argv[i], "-comb"))
+		{
+			i++;
+			if (i >= argc) break;
+			else if (!strcmp(argv[i], "off")) comb = CombFilterModes::CombOff;
+			else if (!strcmp(argv[i], "2line")) comb = CombFilterModes::CombTwoLine;
+			else if (!strcmp(argv[i], "3line")) comb = CombFilterModes::CombThreeLine;
+			else if (!strcmp(argv[i], "3d")) comb = CombFilterModes::CombField;
+		}
 		else if (!strcmp(argv[i], "-text"))
 		{
 			i++;
@@ -231,13 +284,17 @@ int main(int argc, char** argv)
 	const char* cSysStr = GetColourSystemDescriptorString(cSys);
 
 	std::cout << "Encoding to: " << bSysStr << " " << cSysStr << std::endl;
+	if (comb != CombFilterModes::CombOff) std::cout << "Using " << GetCombFilterDescriptorString(comb) << " comb filter." << std::endl;
+	if (quality != QualityTiers::QualityNormal) std::cout << "Using " << GetQualityDescriptorString(quality) << " quality." << std::endl;
+	if (memoryStats) EnableMemoryStats();
 	std::cout << "Initialising engine..." << std::endl;
-	ConversionEngine convEng = ConversionEngine(bSys, cSys, dResonance, pWidthMult, phaseNoise, jitter, noiseExp);
+	ConversionEngine convEng = ConversionEngine(bSys, cSys, dResonance, pWidthMult, phaseNoise, jitter, noiseExp, comb, iirFilters, quality, compactSignals, activeWidth);
+	if (maxMemory > 0.0) convEng.SetMemoryBudget((long long)(maxMemory * 1048576.0));
 	convEng.OpenForDecodeVideo(argv[1]);
 	std::cout << "Begin encoding." << std::endl;
-	convEng.EncodeVideo(argv[2], preview, noise, crosstalk, tlText, timeText);
+	bool memoryClean = convEng.EncodeVideo(argv[2], preview, noise, crosstalk, tlText, timeText, memoryStats);
 	convEng.CloseDecoder();
 	std::cout << "Finished conversion!" << std::endl;
 
-	return 0;
+	return memoryClean ? 0 : 3;
 }